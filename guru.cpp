@@ -26,15 +26,48 @@ SOFTWARE.
 
 #include "guru.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <condition_variable>
 #include <csignal>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <fstream>
+#include <map>
+#include <mutex>
 #include <sstream>
+#include <thread>
+#include <utility>
+#include <vector>
 
-#ifdef GURU_USING_CONSOLE
-#include <cstdio>
+#if defined(__unix__) || defined(__APPLE__)
+#define GURU_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if defined(GURU_USING_STACK_TRACE) && defined(GURU_POSIX)
+#define GURU_SAMPLING_PROFILER	// GURU_PROFILE needs the stack traces to sample, and SIGPROF to sample them with.
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define GURU_TSC
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#ifdef GURU_USING_ZLIB
+#include <zlib.h>
 #endif
 
 #ifdef GURU_USING_CURSES
@@ -46,297 +79,2450 @@ SOFTWARE.
 #include "libtcod/libtcod.h"
 #endif
 
+#if defined(__clang__) && defined(__ELF__)
+// The start and end of the section holding the GURU_LOGF() call sites, defined by the linker if there are any.
+extern "C" guru::CallSite __start_guru_sites[] __attribute__((weak));
+extern "C" guru::CallSite __stop_guru_sites[] __attribute__((weak));
+#endif
+
 namespace guru
 {
 
+#define ASYNC_IDLE_MS			50	// How long the background writer sleeps when it has nothing to do, in case a wake-up call was missed.
 #define CASCADE_THRESHOLD		20	// The amount cascade_count can reach within CASCADE_TIMEOUT seconds before it triggers an abort screen.
 #define CASCADE_TIMEOUT			30	// The number of seconds without an error to reset the cascade timer.
 #define CASCADE_WEIGHT_CRITICAL	4	// The amount a critical type log entry will add to the cascade timer.
 #define CASCADE_WEIGHT_ERROR	2	// The amount an error type log entry will add to the cascade timer.
 #define CASCADE_WEIGHT_WARNING	1	// The amount a warning type log entry will add to the cascade timer.
+#define CLOCK_CALIBRATION_MS	10	// With GURU_CLOCK_TSC, how long open_syslog() spends measuring the timestamp counter's speed. Function timing measures it the same way, the first time it reports.
 #define COLOUR_PAIR_RED			2	// If using Curses, set this to the colour pair number which is red on a black background.
+#define DEDUP_REPLAY			4	// Runs of up to this many repeats are written out in full after all, rather than summarized, if the messages are short enough to have been kept whole.
+#define DEDUP_SUMMARY_LENGTH	60	// How much of a repeated message is quoted when reporting how many times it was repeated.
+#define DEDUP_WINDOW			8	// The number of recent distinct messages that repeats are checked against. Set to 1 to only catch back-to-back repeats.
 #define FILENAME_LOG			"log.txt"	// The default name of the log file. Another filename can be specified with open_syslog().
+#define FLIGHT_RECORDER_SIZE	256	// With GURU_FLIGHT_RECORDER, how many of the most recent records are kept. Must be a power of two.
+#define FLIGHT_RECORD_BUSY		UINT64_MAX	// The stamp of a flight recorder record that's being written.
+#define FLUSH_INTERVAL_MS		1000	// With GURU_FLUSH_INTERVAL, the log file is flushed if this many milliseconds have passed since the last flush. Without GURU_ASYNC, this is only checked when something is logged.
+#define FLUSH_SEVERITY			GURU_ERROR	// With GURU_FLUSH_SEVERITY, log entries of this severity or higher are flushed immediately.
+#define FLUSH_SIZE_THRESHOLD	65536	// With GURU_FLUSH_SIZE, the log file is flushed once this many bytes are waiting to be written.
+#define MMAP_CHUNK_SIZE			4194304	// With GURU_MMAP, the log file is grown and mapped this many bytes at a time. Must be a multiple of the page size.
+#define PROFILE_DEPTH			32	// With GURU_PROFILE, the most frames kept from each sample. Deeper stacks keep their innermost frames.
+#define PROFILE_INTERVAL_US		1000	// With GURU_PROFILE, how many microseconds of CPU time pass between samples.
+#define PROFILE_TABLE_SIZE		4096	// With GURU_PROFILE, how many distinct stacks can be counted. Must be a power of two. Samples of any more are dropped.
+#define ROTATE_KEEP				5	// With GURU_ROTATE, how many old log files are kept, named log.txt.1 (the newest) to log.txt.5, with .gz on the end if they're compressed. Must be at least 1.
+#define ROTATE_MAX_AGE			86400	// With GURU_ROTATE, a new log file is started once the current one is this many seconds old. Checked whenever something is written. Set to 0 to only rotate by size.
+#define ROTATE_MAX_BYTES		16777216	// With GURU_ROTATE, a new log file is started once the current one is this many bytes long. Set to 0 to only rotate by age.
+#define THREAD_QUEUE_SIZE		1024	// The number of records each thread can have waiting to be written. Must be a power of two. When full, log() waits for space rather than dropping records.
+#define TIMING_TABLE_SIZE		1024	// With GURU_USING_FUNCTION_TIMING, how many different functions each thread can time. Must be a power of two.
 
-#ifdef GURU_USING_STACK_TRACE
-// Stack trace system.
-std::stack<const char*>	StackTrace::funcs;
-StackTrace::StackTrace(const char *func) { funcs.push(func); }
-StackTrace::~StackTrace() { if (!funcs.empty()) funcs.pop(); }
+// A record kept by the flight recorder. A thread claims the record by its stamp before replacing it, so two threads never write it at once, and a half-written one can be spotted and skipped.
+struct FlightRecord
+{
+	std::atomic<uint64_t>	stamp = {0};	// The record's position in the flight recorder, plus one, or FLIGHT_RECORD_BUSY while a thread is writing it.
+	int64_t		when;		// From timestamp_now().
+	uint32_t	thread;
+	int			type;
+	bool		deferred;	// Is this a logf() record that still needs formatting?
+	uint32_t	size;
+	char		data[GURU_LOGF_BUFFER];	// Long messages are cut short. logf() records always fit.
+};
+
+// A log record waiting to be written.
+struct LogRecord
+{
+	uint64_t	sequence;	// The order in which records were logged, across all threads.
+	uint32_t	thread;		// The ID of the thread that logged it.
+	int			type;
+	bool		deferred;	// Is this a logf() record that still needs formatting?
+	uint32_t	site;		// The call-site ID of a GURU_LOGF() record, or 0.
+	int64_t		when;		// From timestamp_now(). Converted to the wall-clock time when it's written.
+	std::string	msg;
+};
+
+#ifdef GURU_SAMPLING_PROFILER
+// A distinct stack seen by the sampling profiler, and how many samples landed in it. These are filled in by the SIGPROF handler, so they can't be allocated or locked there.
+struct ProfileSlot
+{
+	std::atomic<uint64_t>	hash = {0};		// The hash of the frames, or 0 if the slot is free.
+	std::atomic<uint64_t>	samples = {0};
+	std::atomic<bool>		ready = {false};	// Have the frames been filled in yet?
+	bool					truncated;		// Were there more frames than PROFILE_DEPTH?
+	unsigned int			count;
+	const StackFrame		*frames[PROFILE_DEPTH];	// Outermost first.
+};
+#endif
+
+// A recently-logged message, remembered by its hash so that repeats of it can be counted rather than written.
+struct RecentMessage
+{
+	bool		used;
+	bool		complete;	// Is the text the whole message, rather than just its start?
+	uint64_t	hash;
+	uint32_t	repeats;	// How many times it's been repeated since it was last written.
+	int			type;
+	uint32_t	thread;
+	size_t		length;		// The length of the quoted part of the message.
+	char		text[DEDUP_SUMMARY_LENGTH];	// The start of the message, to quote when reporting repeats.
+};
+
+// Each thread that logs gets one of these: a single-producer, single-consumer ring buffer of records waiting to be written.
+// They're never freed; when a thread exits, its buffer is handed on to the next new thread that logs something.
+struct ThreadBuffer
+{
+	LogRecord				records[THREAD_QUEUE_SIZE];
+	std::atomic<size_t>		head = {0};			// The next record to be written. Only changed by the writer.
+	std::atomic<size_t>		tail = {0};			// Where the next record will be added. Only changed by the owning thread.
+	std::atomic<bool>		in_use = {true};	// Is this buffer owned by a running thread?
+	uint32_t				thread_id = 0;		// The ID of the thread that owns it.
+	ThreadBuffer*			next = nullptr;		// The next buffer in the thread_buffers list.
+};
+
+// A log file that's been rotated out, waiting to be compressed and moved into place.
+struct RotatedLog
+{
+	std::string	filename;	// Its temporary name.
+	std::string	base;		// The name of the log file it was rotated out of.
+};
+
+#ifdef GURU_USING_FUNCTION_TIMING
+// The calls to one function, and the time spent in them, on one thread. Only the owning thread writes these; the atomics let the report read them at any time.
+struct FunctionTiming
+{
+	std::atomic<const char*>	function = {nullptr};	// nullptr if this entry is free.
+	std::atomic<uint64_t>		calls = {0};
+	std::atomic<uint64_t>		inclusive = {0};	// Ticks spent in the function and everything it called.
+	std::atomic<uint64_t>		exclusive = {0};	// Ticks spent in the function, less the instrumented functions it called.
+};
+
+// Each thread that runs an instrumented function gets one of these. They're never freed, so the timings of threads that have exited are still reported.
+struct TimingTable
+{
+	FunctionTiming			functions[TIMING_TABLE_SIZE];	// A hash table, keyed by the function name's address.
+	std::atomic<uint64_t>	dropped = {0};	// Calls to functions that didn't fit in the table.
+	TimingTable*			next = nullptr;	// The next table in the timing_tables list.
+};
 #endif
 
-unsigned int	cascade_count = 0;		// Keeps track of rapidly-occurring, non-fatal error messages.
-bool			cascade_failure = false;	// Is a cascade failure in progress?
-std::chrono::time_point<std::chrono::system_clock> cascade_timer;	// Timer to check the speed of non-halting Guru warnings, to prevent cascade locks.
+// Hands a thread's buffer back when the thread exits.
+struct ThreadBufferOwner
+{
+	~ThreadBufferOwner() { if (buffer) buffer->in_use.store(false, std::memory_order_release); }
+	ThreadBuffer *buffer = nullptr;
+};
+
+// Only one thread at a time can write to the log file. Rather than waiting for a mutex, log() leaves its record for whoever is already writing.
+// This lock is only waited on by the less time-critical functions, such as flushing and closing the file. It's reentrant, so halt() can't deadlock if it's called mid-write.
+struct WriterLock
+{
+	WriterLock(bool wait = true);
+	~WriterLock();
+	bool locked;
+};
+
+std::atomic<bool>		async_active(false);	// Is the background writer running? If not, each thread writes its own records.
+std::mutex				async_mutex;			// Only used for putting the writer to sleep; log() never locks it.
+std::atomic<bool>		async_sleeping(false);	// Is the writer waiting for something to do?
+std::atomic<bool>		async_stop(false);		// Tells the writer to drain the queue and exit.
+std::thread				async_thread;			// The background writer thread.
+std::condition_variable	async_wake;				// Wakes the writer when a record arrives.
+bool			binary_log = false;		// Are we writing GURU_BINARY records rather than text?
+std::vector<CallSite*>	call_sites;		// Every GURU_LOGF() call site that's been registered, by ID minus one. Only touched while holding a WriterLock.
+std::atomic<int>	capture_level(GURU_INFO);	// The lowest severity that's passed into Guru at all: the log level, or GURU_INFO when using GURU_FLIGHT_RECORDER.
+unsigned int	cascade_count = 0;		// Keeps track of rapidly-occurring, non-fatal error messages. Protected by cascade_mutex.
+std::atomic<bool>	cascade_failure(false);	// Is a cascade failure in progress?
+std::mutex		cascade_mutex;			// Protects cascade_count and cascade_timer, as nonfatal() can be called from any thread.
+std::chrono::time_point<std::chrono::steady_clock> cascade_timer;	// Timer to check the speed of non-halting Guru warnings, to prevent cascade locks. Protected by cascade_mutex.
+int64_t			clock_base = 0;			// A reading of the chosen clock, taken at the same moment as clock_base_wall.
+int64_t			clock_base_wall = 0;	// The wall-clock time of clock_base, in nanoseconds since the Unix epoch.
+double			clock_scale = 1;		// Nanoseconds per tick of the chosen clock.
+std::atomic<int>	clock_source(0);	// Which GURU_CLOCK option is being used to timestamp records, or 0 for the system clock.
+volatile sig_atomic_t	crash_in_progress = 0;	// Is the crash handler already running?
+int32_t			crash_utc_offset = 0;	// The local time's offset from UTC when the log was opened, as the crash handler can't work it out safely.
 bool			dead_already = false;	// Have we already died? Is this crash within the Guru subsystem?
+std::atomic<uint64_t>	flight_next(0);	// The position the next flight recorder record will be written to.
+std::atomic<bool>	flight_recorder(false);	// Is the flight recorder running?
+FlightRecord	flight_records[FLIGHT_RECORDER_SIZE];	// The flight recorder's ring of recent records.
+size_t			flush_pending = 0;		// The number of bytes written to the log since it was last flushed.
+unsigned int	flush_policy = 0;		// The GURU_FLUSH options given to open_syslog().
+std::chrono::time_point<std::chrono::steady_clock> flush_timer;	// When the log file was last flushed.
 bool			fully_active = false;	// Is the Guru system fully activated yet?
-std::string		last_log_message;		// Records the last log message, to avoid spamming the log with repeats.
+std::string		log_line;				// The buffer each log line is assembled in before being written. Reused, so it only allocates until it's grown big enough.
+std::atomic<uint64_t>	log_sequence(0);	// The sequence number of the next record to be logged.
+std::string		logf_text;				// The buffer logf() records are formatted into, reused in the same way.
 std::string		message;				// The error message.
+std::atomic<int>	min_log_level(GURU_INFO);	// The lowest severity that will be logged. Use set_log_level() to change it.
+char*			mmap_data = nullptr;	// The mapped log file, when using GURU_MMAP.
+int				mmap_fd = -1;			// The log file's descriptor, when using GURU_MMAP.
+size_t			mmap_size = 0;			// The size of the mapped log file, including preallocated space that hasn't been written to yet.
+size_t			mmap_used = 0;			// How much of the mapped log file has actually been written.
+std::atomic<uint32_t>	next_thread_id(1);	// The ID for the next thread to start logging.
+#ifdef GURU_SAMPLING_PROFILER
+std::atomic<int>		profile_busy(0);		// How many SIGPROF handlers are running right now.
+std::atomic<uint64_t>	profile_dropped(0);		// Samples that didn't fit in the profile table.
+struct sigaction	profile_old_action;		// Whatever was handling SIGPROF before the profiler started, put back when it stops.
+itimerval		profile_old_timer;		// The profiling timer as it was before the profiler started, put back when it stops.
+std::atomic<ProfileSlot*>	profile_slots(nullptr);	// The profile table, allocated when profiling starts.
+std::atomic<uint64_t>	profile_untraced(0);	// Samples taken when the running thread wasn't inside any stack_trace() function.
+#endif
+std::atomic<RateLimit*>	rate_limits(nullptr);	// Every GURU_LOG_LIMITED() or GURU_NONFATAL_LIMITED() call site that has ever suppressed a message.
+std::atomic<int>	rate_limits_pending(0);	// How many of them have suppressed messages that haven't been reported yet.
+bool			recent_last_written = false;	// Was the last line written to the file the newest entry in recent_messages?
+RecentMessage	recent_messages[DEDUP_WINDOW];	// The last few distinct messages written, to avoid spamming the log with repeats.
+size_t			recent_messages_next = 0;	// The next slot in recent_messages to be replaced.
+size_t			recent_repeat_order[DEDUP_REPLAY];	// Which slots of recent_messages the first few repeats were of, in the order they happened.
+size_t			recent_repeats = 0;		// How many repeats there have been since something new was written.
+bool			rotate_log = false;		// Are we using GURU_ROTATE?
+std::mutex		rotate_mutex;			// Protects rotate_queue and rotate_stop.
+std::vector<RotatedLog>	rotate_queue;	// Rotated log files waiting for the compressor.
+bool			rotate_stop = false;	// Tells the compressor to finish its queue and exit.
+std::thread		rotate_thread;			// The background compressor thread, started when the log is first rotated.
+std::condition_variable	rotate_wake;	// Wakes the compressor when a log file is rotated.
+size_t			segment_size = 0;		// How many bytes have been written to the current log file.
+int64_t			segment_start = 0;		// When the current log file was started, in nanoseconds since the Unix epoch.
+std::vector<Sink*>	sinks;				// Everything else that log output is sent to. Only touched while holding a WriterLock.
+#ifdef GURU_POSIX
+int				syslog_fd = -1;			// The system log file, when not using GURU_MMAP. Written with write(2), so the crash handler can use it too.
+#else
 std::ofstream	syslog;					// The system log file.
+#endif
+char			syslog_buffer[FLUSH_SIZE_THRESHOLD];	// Output waiting to be written to the log file. Kept here rather than in a stream, so the crash handler can write it out before its own records.
+size_t			syslog_buffered = 0;	// How many bytes are waiting in syslog_buffer.
+std::string		syslog_filename;		// The name of the log file.
+unsigned int	syslog_options = 0;		// The options given to open_syslog().
+std::atomic<bool>	syslog_ready(false);	// Is the log file open and ready for records? Safe to check from any thread, unlike syslog_is_open().
+thread_local ThreadBuffer*	thread_buffer = nullptr;	// This thread's buffer, if it's logged anything yet. A plain pointer, so the crash handler can read it without setting anything up.
+thread_local ThreadBufferOwner	thread_buffer_owner;	// Hands thread_buffer back when the thread exits.
+std::atomic<ThreadBuffer*>	thread_buffers(nullptr);	// Every thread buffer ever created.
+#ifdef GURU_USING_FUNCTION_TIMING
+thread_local TimingTable*	timing_table = nullptr;	// This thread's function timings, if it's run an instrumented function yet.
+std::atomic<TimingTable*>	timing_tables(nullptr);	// Every function timing table ever created.
+#endif
+std::atomic<bool>	writer_busy(false);	// Is someone currently writing records to the log file?
+thread_local int	writer_depth = 0;	// How many WriterLocks this thread is holding.
 
-
-// Like assert(), but calls a Guru halt() if the condition is false.
-void affirm(int condition, std::string error)
-{
+void	archive_log(const RotatedLog &rotated);	// Compresses a rotated log file and moves it into place as the newest old log, shuffling the others along.
+void	async_writer();				// The background writer thread's main loop.
+void	calibrate_clock(unsigned int options);	// Picks the clock that records will be timestamped with, and works out how to turn its readings into wall-clock time.
+void	close_syslog_file();		// Closes the log file, whichever way it's being written.
+bool	compress_file(const std::string &from, const std::string &to);	// Writes a gzip-compressed copy of a file. Returns false if this failed.
+void	crash_dump(const char *sig_type);	// Writes the crash report, pending records, flight recorder and stack trace to the log using only async-signal-safe calls.
+size_t	crash_logf(const char *data, size_t size, char *out, size_t capacity);	// Writes out a logf() record's format string followed by its arguments, as printf() can't be used in the crash handler. Returns the length.
+size_t	crash_number(char *out, uint64_t value, int digits = 1, unsigned int base = 10);	// Writes a number, padded with zeroes to at least the given number of digits. Returns its length.
+void	crash_record(int type, uint32_t thread, uint64_t sequence, int64_t when, const char *msg, size_t size);	// Writes one log record from the crash handler.
+int64_t	crash_time();				// Returns the current time, in nanoseconds since the Unix epoch, in an async-signal-safe way.
+void	crash_write(const char *data, size_t size);	// Writes raw bytes to the log file from the crash handler, without allocating, locking or buffering.
+void	dump_flight_recorder();	// Stops the flight recorder and writes its contents to the log, oldest first.
+bool	drain_thread_buffers();		// Writes out every record waiting in the thread buffers, in sequence order. Returns false if there was nothing to write. The caller must hold a WriterLock.
+void	enqueue_record(std::string_view msg, int type, bool deferred, uint32_t site);	// Adds a record to this thread's buffer, then writes it or wakes the writer. If deferred is set, msg holds a binary LogfRecord rather than text.
+void	flush_syslog();				// Forces the log file to be flushed to disk.
+void	flush_syslog_if_due(int type);	// Flushes the log file if the flush policy says it's time to do so.
+void	format_logf_record(std::string_view record, std::string &out);	// Formats the contents of a LogfRecord, as printf() would have.
 #ifdef GURU_USING_STACK_TRACE
-	stack_trace();
+size_t	format_stack_frame(size_t index, const StackFrame &frame, char *out, size_t capacity);	// Writes a line of a stack trace, without allocating, so the crash handler can use it too. Returns the length.
 #endif
-	if (!condition) guru::halt(error);
-}
+const char*	format_time(int64_t when);	// Returns the time of day as HH:MM:SS, only working it out again when the second has changed.
+uint64_t	hash_message(std::string_view msg, int type);	// A quick 64-bit hash of a log message and its severity, used to spot repeats.
+void	log_site_statistics();	// Logs how many times each GURU_LOGF() call site was used, busiest first.
+const char*	logf_format(std::string_view record);	// Returns the format string of a LogfRecord.
+void	mmap_close();				// Unmaps the log file and trims off any unused preallocated space.
+bool	mmap_grow();				// Extends the mapped log file by another chunk. Returns false if this failed.
+bool	mmap_open(const std::string &filename);	// Opens the log file as a memory-mapped file. Returns false if this isn't possible.
+bool	open_plain_file(const std::string &filename, bool append);	// Opens the log file to be written through syslog_buffer, rather than mapped. Returns false if this failed.
+void	open_syslog_file(const std::string &filename);	// Opens a new log file in the way the open_syslog() options ask for, and writes its header if it needs one. The caller must hold a WriterLock.
+#ifdef GURU_SAMPLING_PROFILER
+void	profile_sample(int sig);	// The SIGPROF handler: counts a sample of the running thread's stack in the profile table.
+#endif
+void	queue_rotated_log(const std::string &filename);	// Hands a rotated log file to the compressor, starting it if needed.
+void	record_flight(std::string_view msg, int type, bool deferred);	// Copies a record into the flight recorder.
+bool	records_pending();			// Checks if any thread has records waiting to be written.
+void	register_section_sites();	// Registers every GURU_LOGF() call site in the guru_sites linker section.
+uint32_t	register_site(CallSite &site);	// Gives a GURU_LOGF() call site its ID, and defines it in the binary log. Returns the ID.
+void	report_rate_limits(bool force);	// Logs the counts of messages suppressed by rate-limited call sites, once they're a second old, or straight away if force is set.
+void	rotate_syslog(int64_t when);	// Moves the current log file out of the way and starts a new one. The caller must hold a WriterLock.
+void	rotate_worker();			// The background compressor thread's main loop.
+void	start_async_writer();		// Starts the background writer thread.
+#ifdef GURU_SAMPLING_PROFILER
+void	start_profiler();			// Allocates the profile table and starts the SIGPROF timer.
+#endif
+void	stop_async_writer();		// Drains the background writer's queue, then stops the thread. Further log() calls will be written synchronously.
+#ifdef GURU_SAMPLING_PROFILER
+void	stop_profiler();			// Stops the SIGPROF timer, and writes the profile out as folded stacks.
+#endif
+void	stop_rotate_worker();		// Waits for the compressor to finish its queue, then stops the thread.
+bool	syslog_is_open();			// Checks if the log file is open, whichever way it's being written.
+ThreadBuffer*	this_thread_buffer();	// Returns this thread's buffer, claiming or creating one if needed.
+int64_t	timestamp_now();			// Reads the clock chosen with the GURU_CLOCK options. Use wall_time() to turn this into a real time.
+#ifdef GURU_USING_FUNCTION_TIMING
+double	timing_tick_ns();			// Returns how many nanoseconds each tick of timing_ticks() is, measuring it the first time.
+#endif
+int64_t	wall_clock_now();			// Returns the current time, in nanoseconds since the Unix epoch.
+int64_t	wall_time(int64_t timestamp);	// Turns a reading from timestamp_now() into nanoseconds since the Unix epoch.
+int32_t	utc_offset();				// Returns the local time's current offset from UTC, in seconds.
+void	write_binary_header(Sink *sink);	// Writes the binary log's file header and every call site's definition, to the log file or, if one is given, only to a sink. The caller must hold a WriterLock.
+void	write_log_line(std::string_view msg, const LogRecord &record);	// Writes a log record to the file, unless it's a repeat of a recent message.
+void	write_log_record(std::string_view msg, const LogRecord &record);	// Formats a log record and writes it to the file.
+void	write_pending_records();	// Writes out waiting records, unless another thread is already doing so, in which case it'll pick them up instead.
+void	write_repeat_summaries(int64_t when);	// Reports how many times any recent messages have been repeated since they were last written.
+void	write_site_definition(const CallSite &site, Sink *sink);	// Defines a call site in the binary log, or only in a sink if one is given, so its ID can be resolved. The caller must hold a WriterLock.
+void	write_syslog(const char *data, size_t size);	// Writes raw bytes to the log file, whichever way it's being written.
+void	write_syslog_buffer();		// Writes out whatever is waiting in syslog_buffer.
 
-// Closes the Guru log file.
-void close_syslog()
+
+// Writes log output to another file.
+FileSink::FileSink(const std::string &filename) : file(fopen(filename.c_str(), "wb")) { }
+FileSink::~FileSink() { if (file) fclose(file); }
+void FileSink::flush() { if (file) fflush(file); }
+void FileSink::write(const char *data, size_t size, int) { if (file) fwrite(data, 1, size, file); }
+
+// Logs how many messages have been suppressed, if the first of them was at least a second ago, or if force is set.
+void RateLimit::report_suppressed(int64_t now, bool force)
 {
-#ifdef GURU_USING_STACK_TRACE
-	stack_trace();
-#endif
-	log("Guru system shutting down.");
-	log("The rest is silence.");
-	syslog.close();
+	if (!suppressed.load(std::memory_order_relaxed) || (!force && now - suppressed_since.load(std::memory_order_relaxed) < 1000000000)) return;
+	const uint32_t count = suppressed.exchange(0, std::memory_order_relaxed);
+	if (!count) return;
+	rate_limits_pending.fetch_sub(1, std::memory_order_relaxed);
+	char summary[256];
+	const char *filename = strrchr(file, '/');
+	const int size = snprintf(summary, sizeof(summary), "Suppressed %u messages from %s:%d.", static_cast<unsigned int>(count), filename ? filename + 1 : file, line);
+	log(std::string_view(summary, size < static_cast<int>(sizeof(summary)) ? size : sizeof(summary) - 1), GURU_WARN);
 }
 
-// Tells Guru whether or not the console is initialized and can handle rendering error messages.
-// This is only necessary for Curses, but will have no adverse effects on non-Curses builds.
-void console_ready(bool ready)
+// Notes when a run of suppressed messages began, and puts this call site on the list the writer checks.
+void RateLimit::start_suppressing(const char *file_, int line_, int64_t now)
 {
-	fully_active = ready;
+	suppressed_since.store(now, std::memory_order_relaxed);
+	rate_limits_pending.fetch_add(1, std::memory_order_relaxed);
+	if (listed.exchange(true)) return;
+	file = file_;
+	line = line_;
+	next = rate_limits.load(std::memory_order_relaxed);
+	while (!rate_limits.compare_exchange_weak(next, this, std::memory_order_release, std::memory_order_relaxed)) { }
 }
 
-// Guru meditation error.
-void halt(std::string error)
+// Keeps the most recent log output in memory, overwriting the oldest once it's full.
+MemorySink::MemorySink(size_t capacity) : buffer(capacity, '\0') { }
+
+// Returns a copy of everything held, oldest first. The oldest line may have been partly overwritten.
+std::string MemorySink::contents()
 {
-#ifdef GURU_USING_STACK_TRACE
-	stack_trace();
-#endif
-	log("Software Failure, Halting Execution", GURU_CRITICAL);
-	log(error, GURU_CRITICAL);
+	WriterLock writer_lock;
+	if (!wrapped) return buffer.substr(0, next);
+	return buffer.substr(next) + buffer.substr(0, next);
+}
 
-#ifdef GURU_USING_STACK_TRACE
-	if (StackTrace::funcs.size())
+void MemorySink::write(const char *data, size_t size, int)
+{
+	if (buffer.empty()) return;
+	if (size >= buffer.size())	// Only the end of it will fit.
 	{
-		log("Stack trace follows:", GURU_STACK);
-		while(true)
-		{
-			log(std::to_string(StackTrace::funcs.size() - 1) + ": " + StackTrace::funcs.top(), GURU_STACK);
-			if (StackTrace::funcs.size() > 1) StackTrace::funcs.pop();
-			else break;
-		}
+		memcpy(&buffer[0], data + size - buffer.size(), buffer.size());
+		next = 0;
+		wrapped = true;
+		return;
 	}
-#endif
+	const size_t first = (size < buffer.size() - next ? size : buffer.size() - next);
+	memcpy(&buffer[next], data, first);
+	memcpy(&buffer[0], data + first, size - first);
+	if (next + size >= buffer.size()) wrapped = true;
+	next = (next + size) % buffer.size();
+}
 
-#ifdef GURU_USING_CURSES
-	if (!fully_active) exit(EXIT_FAILURE);
-#ifdef PDCURSES
-	PDC_set_blink(true);
+// Sends log output to a UNIX domain stream socket, such as a log collector. Records that don't fit in the socket's buffer are dropped, and a collector that
+// stops reading partway through one is disconnected. POSIX only; elsewhere, nothing is sent.
+SocketSink::SocketSink(const std::string &path)
+{
+#ifdef GURU_POSIX
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	if (path.size() >= sizeof(address.sun_path)) return;
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, path.c_str(), path.size());
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return;
+	if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)))
+	{
+		close(fd);
+		fd = -1;
+	}
+#ifdef SO_NOSIGPIPE
+	else
+	{
+		const int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+	}
 #endif
+#else
+	(void)path;
 #endif
+}
 
-	if (dead_already)
-	{
-		log("Detected cleanup in process, attempting to die peacefully.", GURU_WARN);
-		exit(EXIT_FAILURE);
-	}
+SocketSink::~SocketSink()
+{
+#ifdef GURU_POSIX
+	if (fd >= 0) close(fd);
+#endif
+}
 
-	message = error;
-#ifdef GURU_USING_CONSOLE
-	printf("Software Failure, Halting Execution\n");
-	printf((message + "\n").c_str());
-	exit(EXIT_FAILURE);
+void SocketSink::write(const char *data, size_t size, int)
+{
+#ifdef GURU_POSIX
+#ifdef MSG_NOSIGNAL
+	const int flags = MSG_NOSIGNAL;	// If the other end goes away, we just want the error rather than a SIGPIPE.
+#else
+	const int flags = 0;
 #endif
-#ifdef GURU_USING_CURSES
-	if (message.size() > 39) message = message.substr(0, 39);
-	bool redraw = true;
-	WINDOW* guru_window = newwin(7, 41, 9, 20);
-	PANEL* guru_panel = new_panel(guru_window);
-	while(true)
+	// The writer mustn't wait on the collector, so a record is dropped if the socket has no room for it. Once part of a record has gone, though, dropping
+	// the rest would garble the stream, so the collector is given up on instead.
+	bool started = false;
+	while (fd >= 0 && size)
 	{
-		if (redraw)
+		const ssize_t sent = send(fd, data, size, flags | MSG_DONTWAIT);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && !started)
 		{
-			redraw = false;
-#ifdef PDCURSES
-			// Workaround to deal with PDCurses' lack of an inbuilt SIGWINCH handler.
-			if (is_termresized())
-			{
-				resize_term(0, 0);
-				if (getmaxx(stdscr) < 80 || getmaxy(stdscr) < 24) resize_term(24, 80);
-			}
-#endif
-			curs_set(0);
-			wclear(guru_window);
-			wattron(guru_window, COLOR_PAIR(COLOUR_PAIR_RED) | A_BOLD | A_BLINK);
-			box(guru_window, 0, 0);
-			wattroff(guru_window, A_BLINK);
-			mvwaddstr(guru_window, 2, 3, "Software Failure, Halting Execution");
-			mvwaddstr(guru_window, 4, 20 - (message.size() / 2), message.c_str());
-			wattroff(guru_window, COLOR_PAIR(COLOUR_PAIR_RED) | A_BOLD);
-			update_panels();
-			refresh();
+			dropped++;
+			return;
 		}
-		int key = getch();
-		if (key == KEY_RESIZE) redraw = true;
-		else if (key == 27)
+		if (sent <= 0)	// The collector has gone away or fallen behind, so give up on it.
 		{
-			curs_set(1);
-			echo();
-			del_panel(guru_panel);
-			delwin(guru_window);
-			endwin();
-			close_syslog();
-			exit(EXIT_FAILURE);
+			close(fd);
+			fd = -1;
+			return;
 		}
+		data += sent;
+		size -= sent;
+		started = true;
 	}
+#else
+	(void)data;
+	(void)size;
 #endif
+}
 
-#ifdef GURU_USING_LIBTCOD
-	TCODConsole guru_con(41, 7);
-	guru_con.setDefaultForeground(TCODColor::red);
-	bool flash_state = false;
-	int redraw_cycle = 50;
-	TCOD_key_t keypress;
-
-	auto redraw_guru_con = [&guru_con, &flash_state]()
-	{
-		guru_con.clear();
-		flash_state = !flash_state;
-		if (flash_state) guru_con.printFrame(0, 0, 41, 7, true, TCOD_BKGND_DEFAULT);
-		guru_con.printf(3, 2, "Software Failure: Halting Execution");
-		guru_con.printf(20 - (message.size() / 2), 4, message.c_str());
-	};
 
-	while (!TCODConsole::isWindowClosed() && keypress.vk != TCODK_ESCAPE)
-	{
-		if (++redraw_cycle >= 50)
-		{
-			redraw_cycle = 0;
-			redraw_guru_con();
-		}
-		TCODConsole::blit(&guru_con, 0, 0, 41, 7, TCODConsole::root, (TCODConsole::root->getWidth() / 2) - 20, (TCODConsole::root->getHeight() / 2) - 3);
-		TCODConsole::flush();
-		TCODSystem::checkForEvent(TCOD_EVENT_KEY_PRESS, &keypress, nullptr);
-		TCODSystem::sleepMilli(10);
-	}
-#endif
 
-#ifndef GURU_USING_CONSOLE
-#ifndef GURU_USING_CURSES
-	exit(EXIT_FAILURE);
-#endif
-#endif
+// Sends everything written to the log file to this sink as well. The sink must stay alive until it's removed, or the log is closed.
+void add_sink(Sink *sink)
+{
+	WriterLock writer_lock;
+	if (!sink) return;
+	sinks.push_back(sink);
+	if (binary_log && syslog_is_open()) write_binary_header(sink);
 }
 
-// As above, but with an exception instead of a string.
-void halt(std::exception &e)
+// Like assert(), but calls a Guru halt() if the condition is false.
+void affirm(int condition, std::string_view error)
 {
 #ifdef GURU_USING_STACK_TRACE
 	stack_trace();
 #endif
-	guru::halt(e.what());
+	if (GURU_UNLIKELY(!condition)) guru::halt(error);
 }
 
-// Catches a segfault or other fatal signal.
-void intercept_signal(int sig)
+// Formats the error message for a failed GURU_AFFIRM(), then halts.
+void affirm_failed(const char *format, ...)
 {
 #ifdef GURU_USING_STACK_TRACE
 	stack_trace();
 #endif
-	std::string sig_type;
-	switch(sig)
+	va_list args, args_copy;
+	va_start(args, format);
+	va_copy(args_copy, args);
+	const int size = vsnprintf(nullptr, 0, format, args);
+	va_end(args);
+	std::string error(size > 0 ? size : 0, '\0');
+	if (size > 0) vsnprintf(&error[0], size + 1, format, args_copy);
+	va_end(args_copy);
+	guru::halt(error);
+}
+
+// Compresses a rotated log file and moves it into place as the newest old log, shuffling the others along and deleting the oldest.
+void archive_log(const RotatedLog &rotated)
+{
+	std::string source = rotated.filename, extension;
+#ifdef GURU_USING_ZLIB
+	if (compress_file(rotated.filename, rotated.filename + ".gz"))
 	{
-		case SIGABRT: sig_type = "Software requested abort."; break;
-		case SIGFPE: sig_type = "Floating-point exception."; break;
-		case SIGILL: sig_type = "Illegal instruction."; break;
-		case SIGSEGV: sig_type = "Segmentation fault."; break;
-		default: sig_type = "Intercepted unknown signal."; break;
+		remove(rotated.filename.c_str());
+		source += ".gz";
+		extension = ".gz";
 	}
+	else remove((rotated.filename + ".gz").c_str());
+#endif
 
-	// Disable the signals for now, to stop a cascade.
-	signal(SIGABRT, SIG_IGN);
-	signal(SIGSEGV, SIG_IGN);
-	signal(SIGILL, SIG_IGN);
-	signal(SIGFPE, SIG_IGN);
-	halt(sig_type);
+	// Old logs are checked for both with and without .gz on the end, in case zlib was only available some of the time.
+	for (int i = ROTATE_KEEP; i >= 1; i--)
+	{
+		for (const char *suffix : { "", ".gz" })
+		{
+			const std::string older = rotated.base + "." + std::to_string(i) + suffix;
+			if (i == ROTATE_KEEP) remove(older.c_str());
+			else rename(older.c_str(), (rotated.base + "." + std::to_string(i + 1) + suffix).c_str());
+		}
+	}
+	rename(source.c_str(), (rotated.base + ".1" + extension).c_str());
 }
 
-// Logs a message in the system log file.
-void log(std::string msg, int type)
+// The background writer thread's main loop.
+void async_writer()
 {
-	if (!syslog.is_open()) return;
-	if (msg == last_log_message) return;
+	while (true)
+	{
+		const bool stopping = async_stop.load();
+		{
+			WriterLock writer_lock;
+			if (drain_thread_buffers()) continue;
+			if (flush_policy & GURU_FLUSH_INTERVAL) flush_syslog_if_due(GURU_INFO);
+		}
+		report_rate_limits(false);
+		if (stopping) break;
 
-	last_log_message = msg;
-	std::string txt_tag;
-	switch(type)
+		// Nothing to do, so go to sleep until log() wakes us up. If a wake-up is missed in the gap between checking the queue and waiting, the timeout catches it.
+		std::unique_lock<std::mutex> lock(async_mutex);
+		async_sleeping.store(true);
+		if (records_pending() || async_stop.load())
+		{
+			async_sleeping.store(false);
+			continue;
+		}
+		async_wake.wait_for(lock, std::chrono::milliseconds(ASYNC_IDLE_MS));
+		async_sleeping.store(false);
+	}
+}
+
+// Picks the clock that records will be timestamped with, and works out how to turn its readings into wall-clock time.
+void calibrate_clock(unsigned int options)
+{
+	int source = 0;
+	double scale = 1;
+	int64_t base = 0;
+#ifdef GURU_TSC
+	unsigned int eax, ebx, ecx, edx;
+	const bool invariant_tsc = __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1 << 8));	// Ticks at a constant rate, whatever the CPU's power state.
+	if ((options & GURU_CLOCK_TSC) && invariant_tsc)
 	{
-		case GURU_INFO:
-#ifdef GURU_USING_STACK_TRACE
-		case GURU_STACK:
+		const auto start = std::chrono::steady_clock::now();
+		const uint64_t start_ticks = __rdtsc();
+		std::this_thread::sleep_for(std::chrono::milliseconds(CLOCK_CALIBRATION_MS));
+		const auto end = std::chrono::steady_clock::now();
+		const uint64_t end_ticks = __rdtsc();
+		if (end_ticks > start_ticks)
+		{
+			source = GURU_CLOCK_TSC;
+			scale = std::chrono::duration<double, std::nano>(end - start).count() / (end_ticks - start_ticks);
+			base = __rdtsc();
+		}
+	}
 #endif
-			break;
-		case GURU_WARN: txt_tag = "[WARN] "; break;
-		case GURU_ERROR: txt_tag = "[ERROR] "; break;
-		case GURU_CRITICAL: txt_tag = "[CRITICAL] "; break;
+#ifdef CLOCK_MONOTONIC_COARSE
+	timespec now;
+	if (!source && (options & GURU_CLOCK_COARSE) && !clock_gettime(CLOCK_MONOTONIC_COARSE, &now))
+	{
+		source = GURU_CLOCK_COARSE;
+		base = static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
 	}
-
-	char* buffer = new char[32];
-	const time_t now = time(nullptr);
-	const tm *ptm = localtime(&now);
-	strftime(&buffer[0], 32, "%H:%M:%S", ptm);
-	std::string time_str = &buffer[0];
-	msg = "[" + time_str + "] " + txt_tag + msg;
-	syslog << msg << std::endl;
-	delete[] buffer;
+#endif
+	(void)options;
+	clock_base = base;
+	clock_base_wall = wall_clock_now();
+	clock_scale = scale;
+	clock_source.store(source, std::memory_order_release);
 }
 
-// Reports a non-fatal error, which will be logged but will not halt execution unless it cascades.
-void nonfatal(std::string error, int type)
+// Closes the Guru log file.
+void close_syslog()
 {
-	if (cascade_failure) return;
 #ifdef GURU_USING_STACK_TRACE
 	stack_trace();
 #endif
+#ifdef GURU_SAMPLING_PROFILER
+	stop_profiler();
+#endif
+	report_rate_limits(true);
+	log_site_statistics();
+#ifdef GURU_USING_FUNCTION_TIMING
+	log_function_timing();
+#endif
+	log("Guru system shutting down.");
+	log("The rest is silence.");
+	stop_async_writer();
+	{
+		WriterLock writer_lock;
+		drain_thread_buffers();
+		write_repeat_summaries(timestamp_now());
+		syslog_ready.store(false);
+		flight_recorder.store(false);
+		capture_level.store(min_log_level.load());
+		close_syslog_file();
+		for (Sink *sink : sinks) sink->flush();
+		sinks.clear();
+	}
+	stop_rotate_worker();
+}
+
+// Closes the log file, whichever way it's being written.
+void close_syslog_file()
+{
+	if (mmap_data) mmap_close();
+	write_syslog_buffer();
+#ifdef GURU_POSIX
+	if (syslog_fd >= 0) close(syslog_fd);
+	syslog_fd = -1;
+#else
+	syslog.close();
+#endif
+}
 
-	unsigned int cascade_weight = 0;
-	switch(type)
+// Writes a gzip-compressed copy of a file. Returns false if this failed.
+bool compress_file(const std::string &from, const std::string &to)
+{
+#ifdef GURU_USING_ZLIB
+	FILE *in = fopen(from.c_str(), "rb");
+	if (!in) return false;
+	gzFile out = gzopen(to.c_str(), "wb");
+	if (!out)
 	{
-		case GURU_WARN: cascade_weight = CASCADE_WEIGHT_WARNING; break;
-		case GURU_ERROR: cascade_weight = CASCADE_WEIGHT_ERROR; break;
-		case GURU_CRITICAL: cascade_weight = CASCADE_WEIGHT_CRITICAL; break;
-		default: nonfatal("Nonfatal error reported with incorrect severity specified.", GURU_WARN); break;
+		fclose(in);
+		return false;
 	}
+	static char buffer[65536];	// Only ever used by the compressor thread.
+	bool success = true;
+	size_t size;
+	while (success && (size = fread(buffer, 1, sizeof(buffer), in)) > 0)
+		success = (gzwrite(out, buffer, static_cast<unsigned int>(size)) == static_cast<int>(size));
+	if (ferror(in)) success = false;
+	fclose(in);
+	if (gzclose(out) != Z_OK) success = false;
+	return success;
+#else
+	(void)from;
+	(void)to;
+	return false;
+#endif
+}
 
-	guru::log(error, type);
+// Tells Guru whether or not the console is initialized and can handle rendering error messages.
+// This is only necessary for Curses, but will have no adverse effects on non-Curses builds.
+void console_ready(bool ready)
+{
+	fully_active = ready;
+}
 
-	if (cascade_weight)
+// Writes the crash report, pending records, flight recorder and stack trace to the log using only async-signal-safe calls.
+// Nothing here allocates, locks, or uses the C++ streams, so it still works if the crash happened inside malloc() or while another thread was writing.
+void crash_dump(const char *sig_type)
+{
+#ifdef GURU_POSIX
+	// Whatever was already formatted but not yet written out comes first. It's taken out of the buffer, so a later flush won't write it again.
+	const size_t buffered = syslog_buffered;
+	syslog_buffered = 0;
+	crash_write(syslog_buffer, buffered);
+
+	// Anything still waiting in the thread buffers, in sequence order. Nothing is taken out of the buffers, as they could be in use elsewhere.
+	// Each buffer's records are already in order, so it's enough to find the lowest sequence number after the last one written.
+	char line[1024];
+	bool any_written = false;
+	uint64_t last_written = 0;
+	while (true)
 	{
-		std::chrono::duration<float> elapsed_seconds = std::chrono::system_clock::now() - cascade_timer;
-		if (elapsed_seconds.count() <= CASCADE_TIMEOUT)
+		const LogRecord *next = nullptr;
+		for (ThreadBuffer *buffer = thread_buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next)
 		{
-			cascade_count += cascade_weight;
-			if (cascade_count > CASCADE_THRESHOLD)
+			const size_t tail = buffer->tail.load(std::memory_order_acquire);
+			for (size_t i = buffer->head.load(std::memory_order_acquire); i != tail; i++)
 			{
-				cascade_failure = true;
-				guru::halt("Cascade failure detected!");
+				const LogRecord &record = buffer->records[i & (THREAD_QUEUE_SIZE - 1)];
+				if (any_written && record.sequence <= last_written) continue;
+				if (!next || record.sequence < next->sequence) next = &record;
+				break;
 			}
 		}
-		else
+		if (!next) break;
+		any_written = true;
+		last_written = next->sequence;
+		if (!next->deferred) crash_record(next->type, next->thread, next->sequence, wall_time(next->when), next->msg.data(), next->msg.size());
+		else crash_record(next->type, next->thread, next->sequence, wall_time(next->when), line, crash_logf(next->msg.data(), next->msg.size(), line, sizeof(line)));
+	}
+
+	const uint32_t thread = thread_buffer ? thread_buffer->thread_id : 0;
+	if (flight_recorder.load())
+	{
+		static const char flight_start[] = "Flight recorder follows, oldest first:";
+		crash_record(GURU_INFO, 0, 0, crash_time(), flight_start, sizeof(flight_start) - 1);
+		const uint64_t end = flight_next.load(std::memory_order_acquire);
+		for (uint64_t i = (end > FLIGHT_RECORDER_SIZE ? end - FLIGHT_RECORDER_SIZE : 0); i < end; i++)
 		{
-			cascade_timer = std::chrono::system_clock::now();
-			cascade_count = 0;
+			const FlightRecord &flight = flight_records[i & (FLIGHT_RECORDER_SIZE - 1)];
+			if (flight.stamp.load(std::memory_order_acquire) != i + 1) continue;
+			if (!flight.deferred) crash_record(flight.type, flight.thread, 0, wall_time(flight.when), flight.data, flight.size);
+			else crash_record(flight.type, flight.thread, 0, wall_time(flight.when), line, crash_logf(flight.data, flight.size, line, sizeof(line)));
 		}
+		static const char flight_end[] = "End of flight recorder.";
+		crash_record(GURU_INFO, 0, 0, crash_time(), flight_end, sizeof(flight_end) - 1);
 	}
-}
 
-// Opens the output log for messages.
-void open_syslog(std::string filename)
-{
-	if (!filename.size()) filename = FILENAME_LOG;
-	remove(filename.c_str());
-	syslog.open(filename.c_str());
+	static const char banner[] = "Software Failure, Halting Execution";
+	crash_record(GURU_CRITICAL, thread, 0, crash_time(), banner, sizeof(banner) - 1);
+	crash_record(GURU_CRITICAL, thread, 0, crash_time(), sig_type, strlen(sig_type));
+
+#ifdef GURU_USING_STACK_TRACE
+	if (StackTrace::depth)
+	{
+		static const char trace_start[] = "Stack trace follows:";
+		crash_record(GURU_STACK, thread, 0, crash_time(), trace_start, sizeof(trace_start) - 1);
+		if (StackTrace::depth > GURU_STACK_DEPTH)
+		{
+			size_t size = crash_number(line, StackTrace::depth - GURU_STACK_DEPTH);
+			static const char overflowed[] = " deeper frames were not recorded.";
+			memcpy(line + size, overflowed, sizeof(overflowed) - 1);
+			crash_record(GURU_STACK, thread, 0, crash_time(), line, size + sizeof(overflowed) - 1);
+		}
+		for (size_t i = std::min<size_t>(StackTrace::depth, GURU_STACK_DEPTH); i > 0; i--)
+			crash_record(GURU_STACK, thread, 0, crash_time(), line, format_stack_frame(i - 1, *StackTrace::frames[i - 1], line, sizeof(line)));
+	}
+#endif
+
+	if (write(STDERR_FILENO, sig_type, strlen(sig_type)) && write(STDERR_FILENO, "\n", 1)) { }
+#else
+	(void)sig_type;
+#endif
+}
+
+// Writes out a logf() record's format string followed by its arguments, as printf() can't be used in the crash handler. Returns the length.
+size_t crash_logf(const char *data, size_t size, char *out, size_t capacity)
+{
+	size_t written = 0;
+	auto append = [&written, out, capacity](const char *str, size_t len) { while (len-- && written < capacity) out[written++] = *str++; };
+	const char *format = logf_format(std::string_view(data, size));
+	append(format, strlen(format));
+
+	char number[64];
+	const char *separator = " [";
+	size_t pos = 1 + sizeof(void*);
+	while (pos < size)
+	{
+		append(separator, 2);
+		separator = ", ";
+		const char tag = data[pos++];
+		switch(tag)
+		{
+			case 'i':
+			{
+				int64_t value;
+				memcpy(&value, data + pos, sizeof(value));
+				if (value < 0) append("-", 1);
+				append(number, crash_number(number, value < 0 ? 0 - static_cast<uint64_t>(value) : value));
+				pos += sizeof(value);
+				break;
+			}
+			case 'u':
+			{
+				uint64_t value;
+				memcpy(&value, data + pos, sizeof(value));
+				append(number, crash_number(number, value));
+				pos += sizeof(value);
+				break;
+			}
+			case 'd': case 'L':
+			{
+				long double value;
+				if (tag == 'd')
+				{
+					double value_double;
+					memcpy(&value_double, data + pos, sizeof(value_double));
+					value = value_double;
+					pos += sizeof(value_double);
+				}
+				else
+				{
+					memcpy(&value, data + pos, sizeof(value));
+					pos += sizeof(value);
+				}
+				if (value < 0)
+				{
+					append("-", 1);
+					value = -value;
+				}
+				if (!(value < 1e18L)) append("(large)", 7);	// Also catches NaN and infinity.
+				else
+				{
+					const uint64_t whole = static_cast<uint64_t>(value);
+					append(number, crash_number(number, whole));
+					append(".", 1);
+					append(number, crash_number(number, static_cast<uint64_t>((value - whole) * 1000000), 6));
+				}
+				break;
+			}
+			case 'p':
+			{
+				const void *value;
+				memcpy(&value, data + pos, sizeof(value));
+				append("0x", 2);
+				append(number, crash_number(number, reinterpret_cast<uintptr_t>(value), 1, 16));
+				pos += sizeof(value);
+				break;
+			}
+			case 's':
+			{
+				uint32_t len;
+				memcpy(&len, data + pos, sizeof(len));
+				append(data + pos + sizeof(len), len);
+				pos += sizeof(len) + len + 1;
+				break;
+			}
+			default: pos = size; break;
+		}
+	}
+	if (separator[0] == ',') append("]", 1);
+	return written;
+}
+
+// Writes a number, padded with zeroes to at least the given number of digits. Returns its length.
+size_t crash_number(char *out, uint64_t value, int digits, unsigned int base)
+{
+	char reversed[64];
+	size_t size = 0;
+	do
+	{
+		reversed[size++] = "0123456789abcdef"[value % base];
+		value /= base;
+	} while (value || static_cast<int>(size) < digits);
+	for (size_t i = 0; i < size; i++)
+		out[i] = reversed[size - 1 - i];
+	return size;
+}
+
+// Writes one log record from the crash handler.
+void crash_record(int type, uint32_t thread, uint64_t sequence, int64_t when, const char *msg, size_t size)
+{
+	if (binary_log)
+	{
+		char header[GURU_BINARY_RECORD_SIZE];
+		const uint8_t type_byte = static_cast<uint8_t>(type);
+		const uint32_t site = 0, msg_size = static_cast<uint32_t>(size);
+		memcpy(header, &when, sizeof(when));
+		memcpy(header + 8, &type_byte, sizeof(type_byte));
+		memcpy(header + 9, &site, sizeof(site));
+		memcpy(header + 13, &thread, sizeof(thread));
+		memcpy(header + 17, &sequence, sizeof(sequence));
+		memcpy(header + 25, &msg_size, sizeof(msg_size));
+		crash_write(header, sizeof(header));
+		crash_write(msg, size);
+		return;
+	}
+
+	// The same layout as write_log_record(), but without localtime() or snprintf().
+	char prefix[48];
+	int64_t seconds = (when / 1000000000 + crash_utc_offset) % 86400;
+	if (seconds < 0) seconds += 86400;
+	size_t pos = 0;
+	prefix[pos++] = '[';
+	pos += crash_number(prefix + pos, seconds / 3600, 2);
+	prefix[pos++] = ':';
+	pos += crash_number(prefix + pos, (seconds / 60) % 60, 2);
+	prefix[pos++] = ':';
+	pos += crash_number(prefix + pos, seconds % 60, 2);
+	prefix[pos++] = ']';
+	prefix[pos++] = ' ';
+	if (thread > 1)
+	{
+		prefix[pos++] = '[';
+		prefix[pos++] = 'T';
+		pos += crash_number(prefix + pos, thread);
+		prefix[pos++] = ']';
+		prefix[pos++] = ' ';
+	}
+	const char *tag = "";
+	switch(type)
+	{
+		case GURU_WARN: tag = "[WARN] "; break;
+		case GURU_ERROR: tag = "[ERROR] "; break;
+		case GURU_CRITICAL: tag = "[CRITICAL] "; break;
+	}
+	while (*tag) prefix[pos++] = *tag++;
+	crash_write(prefix, pos);
+	crash_write(msg, size);
+	crash_write("\n", 1);
+}
+
+// Returns the current time, in nanoseconds since the Unix epoch, in an async-signal-safe way.
+int64_t crash_time()
+{
+#ifdef GURU_POSIX
+	timespec now;
+	if (clock_gettime(CLOCK_REALTIME, &now)) return 0;
+	return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+#else
+	return 0;
+#endif
+}
+
+// Writes raw bytes to the log file from the crash handler, without allocating, locking or buffering.
+void crash_write(const char *data, size_t size)
+{
+#ifdef GURU_POSIX
+	if (mmap_data)	// The file can't be grown in here, so anything past the end of the mapping is lost.
+	{
+		if (size > mmap_size - mmap_used) size = mmap_size - mmap_used;
+		memcpy(mmap_data + mmap_used, data, size);
+		mmap_used += size;
+		return;
+	}
+	while (syslog_fd >= 0 && size)
+	{
+		const ssize_t written = write(syslog_fd, data, size);
+		if (written < 0 && errno == EINTR) continue;
+		if (written <= 0) return;
+		data += written;
+		size -= written;
+	}
+#else
+	(void)data;
+	(void)size;
+#endif
+}
+
+// Stops the flight recorder and writes its contents to the log, oldest first.
+void dump_flight_recorder()
+{
+	if (!flight_recorder.exchange(false)) return;
+	capture_level.store(min_log_level.load());
+	WriterLock writer_lock;
+	drain_thread_buffers();	// Get everything that's already been logged written out first, so the dump doesn't get mixed in with it.
+	write_repeat_summaries(timestamp_now());
+
+	LogRecord record;
+	record.sequence = 0;
+	record.thread = 0;
+	record.type = GURU_INFO;
+	record.deferred = false;
+	record.site = 0;
+	record.when = timestamp_now();
+	write_log_record("Flight recorder follows, oldest first:", record);
+	char data[GURU_LOGF_BUFFER];
+	const uint64_t end = flight_next.load(std::memory_order_acquire);
+	for (uint64_t i = (end > FLIGHT_RECORDER_SIZE ? end - FLIGHT_RECORDER_SIZE : 0); i < end; i++)
+	{
+		// Another thread might still be writing this record, in which case it's skipped.
+		const FlightRecord &flight = flight_records[i & (FLIGHT_RECORDER_SIZE - 1)];
+		if (flight.stamp.load(std::memory_order_acquire) != i + 1) continue;
+		record.when = flight.when;
+		record.thread = flight.thread;
+		record.type = flight.type;
+		const bool deferred = flight.deferred;
+		const uint32_t size = flight.size;
+		memcpy(data, flight.data, size);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (flight.stamp.load(std::memory_order_relaxed) != i + 1) continue;
+
+		if (!deferred) write_log_record(std::string_view(data, size), record);
+		else
+		{
+			format_logf_record(std::string_view(data, size), logf_text);
+			write_log_record(logf_text, record);
+		}
+	}
+	record.thread = 0;
+	record.type = GURU_INFO;
+	record.when = timestamp_now();
+	write_log_record("End of flight recorder.", record);
+}
+
+// Writes out every record waiting in the thread buffers, in sequence order. Returns false if there was nothing to write. The caller must hold a WriterLock.
+bool drain_thread_buffers()
+{
+	bool drained = false;
+	while (true)
+	{
+		// Find the oldest record waiting in any thread's buffer. A record still being added by another thread can turn up later with a lower sequence number,
+		// which is why the sequence numbers are kept in binary logs.
+		ThreadBuffer *oldest = nullptr;
+		size_t oldest_head = 0;
+		for (ThreadBuffer *buffer = thread_buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next)
+		{
+			const size_t head = buffer->head.load(std::memory_order_relaxed);
+			if (head == buffer->tail.load(std::memory_order_acquire)) continue;
+			if (!oldest || buffer->records[head & (THREAD_QUEUE_SIZE - 1)].sequence < oldest->records[oldest_head & (THREAD_QUEUE_SIZE - 1)].sequence)
+			{
+				oldest = buffer;
+				oldest_head = head;
+			}
+		}
+		if (!oldest) break;
+
+		const LogRecord &record = oldest->records[oldest_head & (THREAD_QUEUE_SIZE - 1)];
+		if (record.deferred && !(binary_log && record.site))	// Binary logs keep the arguments of GURU_LOGF() records as they are.
+		{
+			format_logf_record(record.msg, logf_text);
+			write_log_line(logf_text, record);
+		}
+		else write_log_line(record.msg, record);
+		oldest->head.store(oldest_head + 1, std::memory_order_release);
+		drained = true;
+	}
+	return drained;
+}
+
+// Adds a record to this thread's buffer, then writes it or wakes the writer. If deferred is set, msg holds a binary LogfRecord rather than text.
+void enqueue_record(std::string_view msg, int type, bool deferred, uint32_t site)
+{
+	if (!syslog_ready.load(std::memory_order_acquire)) return;
+	ThreadBuffer *buffer = this_thread_buffer();
+	const size_t tail = buffer->tail.load(std::memory_order_relaxed);
+	while (tail - buffer->head.load(std::memory_order_acquire) >= THREAD_QUEUE_SIZE)
+	{
+		// This thread's buffer is full, so wait for it to be written out.
+		if (async_active.load()) async_wake.notify_one();
+		else write_pending_records();
+		std::this_thread::yield();
+	}
+
+	LogRecord &record = buffer->records[tail & (THREAD_QUEUE_SIZE - 1)];
+	record.thread = buffer->thread_id;
+	record.type = type;
+	record.deferred = deferred;
+	record.site = site;
+	record.when = timestamp_now();
+	record.msg.assign(msg);	// The record's string keeps its capacity between uses, so this only allocates until the buffer has warmed up.
+	record.sequence = log_sequence.fetch_add(1, std::memory_order_relaxed);
+	buffer->tail.store(tail + 1, std::memory_order_release);
+
+	if (!async_active.load(std::memory_order_acquire)) write_pending_records();
+	else if (async_sleeping.load()) async_wake.notify_one();
+}
+
+// Forces the log file to be flushed to disk.
+void flush_syslog()
+{
+	WriterLock writer_lock;
+	for (Sink *sink : sinks) sink->flush();
+	if (!syslog_is_open()) return;
+	if (!mmap_data) write_syslog_buffer();	// A mapped file is already in the page cache, so there's nothing to flush.
+#ifndef GURU_POSIX
+	syslog.flush();
+#endif
+	flush_pending = 0;
+	flush_timer = std::chrono::steady_clock::now();
+}
+
+// Flushes the log file if the flush policy says it's time to do so.
+void flush_syslog_if_due(int type)
+{
+	if (!flush_pending) return;
+	if (!flush_policy) flush_syslog();
+	else if ((flush_policy & GURU_FLUSH_SEVERITY) && type >= FLUSH_SEVERITY) flush_syslog();
+	else if ((flush_policy & GURU_FLUSH_SIZE) && flush_pending >= FLUSH_SIZE_THRESHOLD) flush_syslog();
+	else if ((flush_policy & GURU_FLUSH_INTERVAL) && std::chrono::steady_clock::now() - flush_timer >= std::chrono::milliseconds(FLUSH_INTERVAL_MS)) flush_syslog();
+}
+
+// Formats the contents of a LogfRecord, as printf() would have.
+void format_logf(const char *format, std::string_view args, std::string &out)
+{
+	out.clear();
+	size_t pos = 0;
+	bool corrupt = false;	// Set if the arguments don't fit in what was captured, as can happen with a damaged binary log.
+
+	// Reads the next captured argument. Returns its type byte, or 0 if there are no arguments left or they're corrupt.
+	auto next_arg = [&args, &pos, &corrupt](const char *&value, uint32_t &len) -> char
+	{
+		if (corrupt || pos >= args.size()) return 0;
+		const char tag = args[pos++];
+		switch(tag)
+		{
+			case 'i': case 'u': len = sizeof(int64_t); break;
+			case 'd': len = sizeof(double); break;
+			case 'L': len = sizeof(long double); break;
+			case 'p': len = sizeof(void*); break;
+			case 's':
+				if (args.size() - pos < sizeof(len)) { corrupt = true; return 0; }
+				memcpy(&len, args.data() + pos, sizeof(len));
+				pos += sizeof(len);
+				if (args.size() - pos <= len || args[pos + len] != '\0') { corrupt = true; return 0; }	// The string must be followed by its terminator.
+				value = args.data() + pos;
+				pos += len + 1;
+				return tag;
+			default: corrupt = true; return 0;
+		}
+		if (args.size() - pos < len) { corrupt = true; return 0; }
+		value = args.data() + pos;
+		pos += len;
+		return tag;
+	};
+
+	// Formats a single value with snprintf(), straight into the output.
+	auto append = [&out](const char *spec, auto value)
+	{
+		char buffer[128];
+		const int size = snprintf(buffer, sizeof(buffer), spec, value);
+		if (size <= 0) return;
+		if (size < static_cast<int>(sizeof(buffer))) out.append(buffer, size);
+		else
+		{
+			const size_t old_size = out.size();
+			out.resize(old_size + size + 1);
+			snprintf(&out[old_size], size + 1, spec, value);
+			out.resize(old_size + size);
+		}
+	};
+
+	const char *c = format;
+	while (*c)
+	{
+		const char *next = strchr(c, '%');
+		if (!next)
+		{
+			out.append(c);
+			break;
+		}
+		out.append(c, next - c);
+		c = next + 1;
+		if (*c == '%')
+		{
+			out.push_back('%');
+			c++;
+			continue;
+		}
+
+		// Rebuild the conversion spec, leaving out the length modifier; the right one is added below, based on what was actually captured.
+		char spec[64] = "%";
+		size_t spec_len = 1;
+		const char *value;
+		uint32_t len;
+		auto spec_add = [&spec, &spec_len](const char *str, size_t size) { if (spec_len + size < sizeof(spec) - 4) { for (size_t i = 0; i < size; i++) spec[spec_len++] = str[i]; spec[spec_len] = '\0'; } };
+		auto spec_star = [&]()	// Width or precision taken from an argument.
+		{
+			int64_t star = 0;
+			const char tag = next_arg(value, len);
+			if (tag == 'i' || tag == 'u') memcpy(&star, value, sizeof(star));
+			char number[24];
+			spec_add(number, snprintf(number, sizeof(number), "%lld", static_cast<long long>(star)));
+			c++;
+		};
+		while (*c && strchr("-+ #0'", *c)) spec_add(c++, 1);
+		if (*c == '*') spec_star();
+		else while (*c >= '0' && *c <= '9') spec_add(c++, 1);
+		if (*c == '.')
+		{
+			spec_add(c++, 1);
+			if (*c == '*') spec_star();
+			else while (*c >= '0' && *c <= '9') spec_add(c++, 1);
+		}
+		while (*c && strchr("hljztLq", *c)) c++;
+		const char conv = *c;
+		if (!conv) break;
+		c++;
+
+		const char tag = next_arg(value, len);
+		if (corrupt) break;	// Stop here rather than guess at the rest.
+		if (!tag || conv == 'n')
+		{
+			out.append(next, c - next);	// Missing argument, so just print the spec as it was.
+			continue;
+		}
+		const bool float_conv = strchr("fFeEgGaA", conv);
+		const bool int_conv = strchr("diouxXc", conv);
+		auto spec_conv = [&](const char *length, char fallback)
+		{
+			spec_add(length, strlen(length));
+			spec_add(fallback ? &fallback : &conv, 1);
+		};
+		switch(tag)
+		{
+			case 'i': case 'u':
+			{
+				int64_t number;
+				memcpy(&number, value, sizeof(number));
+				if (float_conv) { spec_conv("", 0); append(spec, static_cast<double>(number)); }
+				else if (conv == 'c') { spec_conv("", 0); append(spec, static_cast<int>(number)); }
+				else if (int_conv) { spec_conv("ll", 0); append(spec, static_cast<long long>(number)); }
+				else { spec_conv("ll", tag == 'i' ? 'd' : 'u'); append(spec, static_cast<long long>(number)); }
+				break;
+			}
+			case 'd':
+			{
+				double number;
+				memcpy(&number, value, sizeof(number));
+				spec_conv("", float_conv ? 0 : 'g');
+				append(spec, number);
+				break;
+			}
+			case 'L':
+			{
+				long double number;
+				memcpy(&number, value, sizeof(number));
+				spec_conv("L", float_conv ? 0 : 'g');
+				append(spec, number);
+				break;
+			}
+			case 'p':
+			{
+				const void *pointer;
+				memcpy(&pointer, value, sizeof(pointer));
+				spec_conv("", 'p');
+				append(spec, pointer);
+				break;
+			}
+			case 's':
+				spec_conv("", 's');
+				if (spec_len == 2) out.append(value, len);
+				else append(spec, value);
+				break;
+		}
+	}
+}
+
+// Formats the contents of a LogfRecord, as printf() would have.
+void format_logf_record(std::string_view record, std::string &out)
+{
+	if (record.size() < 1 + sizeof(void*)) out.clear();
+	else format_logf(logf_format(record), record.substr(1 + sizeof(void*)), out);
+}
+
+#ifdef GURU_USING_STACK_TRACE
+// Writes a line of a stack trace, without allocating, so the crash handler can use it too. Returns the length.
+size_t format_stack_frame(size_t index, const StackFrame &frame, char *out, size_t capacity)
+{
+	char number[24];
+	size_t size = 0;
+	auto append = [&size, out, capacity](const char *str, size_t len) { while (len-- && *str && size < capacity) out[size++] = *str++; };
+	append(number, crash_number(number, index));
+	append(": ", 2);
+	append(frame.function, SIZE_MAX);
+	append(" (", 2);
+	append(frame.file, SIZE_MAX);
+	append(":", 1);
+	append(number, crash_number(number, frame.line));
+	append(")", 1);
+	if (frame.tag)
+	{
+		append(" [", 2);
+		append(frame.tag, SIZE_MAX);
+		append("]", 1);
+	}
+	return size;
+}
+#endif
+
+// Returns the time of day as HH:MM:SS, only working it out again when the second has changed.
+const char* format_time(int64_t when)
+{
+	// Each thread keeps its own copy, so there's no locking, and localtime() is only called once per second at most.
+	thread_local time_t	cached_time = -1;
+	thread_local char	cached_text[16];
+	const time_t seconds = static_cast<time_t>(when / 1000000000);
+	if (seconds == cached_time) return cached_text;
+
+	tm local;
+#ifdef _WIN32
+	localtime_s(&local, &seconds);
+#else
+	localtime_r(&seconds, &local);
+#endif
+	strftime(cached_text, sizeof(cached_text), "%H:%M:%S", &local);
+	cached_time = seconds;
+	return cached_text;
+}
+
+// A quick 64-bit hash of a log message and its severity, used to spot repeats.
+uint64_t hash_message(std::string_view msg, int type)
+{
+	// FNV-1a, but taking eight bytes at a time.
+	uint64_t hash = 14695981039346656037ULL ^ static_cast<uint64_t>(type);
+	const char *data = msg.data();
+	size_t size = msg.size();
+	for (; size >= 8; data += 8, size -= 8)
+	{
+		uint64_t word;
+		memcpy(&word, data, 8);
+		hash = (hash ^ word) * 1099511628211ULL;
+	}
+	for (; size; data++, size--)
+		hash = (hash ^ static_cast<unsigned char>(*data)) * 1099511628211ULL;
+	return hash ^ (hash >> 29);
+}
+
+// Guru meditation error.
+void halt(std::string_view error)
+{
+#ifdef GURU_USING_STACK_TRACE
+	stack_trace();
+#endif
+	dump_flight_recorder();
+	log("Software Failure, Halting Execution", GURU_CRITICAL);
+	log(error, GURU_CRITICAL);
+
+#ifdef GURU_USING_STACK_TRACE
+	if (StackTrace::depth)
+	{
+		log("Stack trace follows:", GURU_STACK);
+		if (StackTrace::depth > GURU_STACK_DEPTH) log(std::to_string(StackTrace::depth - GURU_STACK_DEPTH) + " deeper frames were not recorded.", GURU_STACK);
+		char line[1024];
+		for (size_t i = std::min<size_t>(StackTrace::depth, GURU_STACK_DEPTH); i > 0; i--)
+			log(std::string_view(line, format_stack_frame(i - 1, *StackTrace::frames[i - 1], line, sizeof(line))), GURU_STACK);
+	}
+#endif
+	stop_async_writer();
+	{
+		WriterLock writer_lock;
+		drain_thread_buffers();
+		write_repeat_summaries(timestamp_now());
+	}
+	flush_syslog();
+
+#ifdef GURU_USING_CURSES
+	if (!fully_active) exit(EXIT_FAILURE);
+#ifdef PDCURSES
+	PDC_set_blink(true);
+#endif
+#endif
+
+	if (dead_already)
+	{
+		log("Detected cleanup in process, attempting to die peacefully.", GURU_WARN);
+		exit(EXIT_FAILURE);
+	}
+
+	message = error;
+#ifdef GURU_USING_CONSOLE
+	printf("Software Failure, Halting Execution\n");
+	printf((message + "\n").c_str());
+	exit(EXIT_FAILURE);
+#endif
+#ifdef GURU_USING_CURSES
+	if (message.size() > 39) message = message.substr(0, 39);
+	bool redraw = true;
+	WINDOW* guru_window = newwin(7, 41, 9, 20);
+	PANEL* guru_panel = new_panel(guru_window);
+	while(true)
+	{
+		if (redraw)
+		{
+			redraw = false;
+#ifdef PDCURSES
+			// Workaround to deal with PDCurses' lack of an inbuilt SIGWINCH handler.
+			if (is_termresized())
+			{
+				resize_term(0, 0);
+				if (getmaxx(stdscr) < 80 || getmaxy(stdscr) < 24) resize_term(24, 80);
+			}
+#endif
+			curs_set(0);
+			wclear(guru_window);
+			wattron(guru_window, COLOR_PAIR(COLOUR_PAIR_RED) | A_BOLD | A_BLINK);
+			box(guru_window, 0, 0);
+			wattroff(guru_window, A_BLINK);
+			mvwaddstr(guru_window, 2, 3, "Software Failure, Halting Execution");
+			mvwaddstr(guru_window, 4, 20 - (message.size() / 2), message.c_str());
+			wattroff(guru_window, COLOR_PAIR(COLOUR_PAIR_RED) | A_BOLD);
+			update_panels();
+			refresh();
+		}
+		int key = getch();
+		if (key == KEY_RESIZE) redraw = true;
+		else if (key == 27)
+		{
+			curs_set(1);
+			echo();
+			del_panel(guru_panel);
+			delwin(guru_window);
+			endwin();
+			close_syslog();
+			exit(EXIT_FAILURE);
+		}
+	}
+#endif
+
+#ifdef GURU_USING_LIBTCOD
+	TCODConsole guru_con(41, 7);
+	guru_con.setDefaultForeground(TCODColor::red);
+	bool flash_state = false;
+	int redraw_cycle = 50;
+	TCOD_key_t keypress;
+
+	auto redraw_guru_con = [&guru_con, &flash_state]()
+	{
+		guru_con.clear();
+		flash_state = !flash_state;
+		if (flash_state) guru_con.printFrame(0, 0, 41, 7, true, TCOD_BKGND_DEFAULT);
+		guru_con.printf(3, 2, "Software Failure: Halting Execution");
+		guru_con.printf(20 - (message.size() / 2), 4, message.c_str());
+	};
+
+	while (!TCODConsole::isWindowClosed() && keypress.vk != TCODK_ESCAPE)
+	{
+		if (++redraw_cycle >= 50)
+		{
+			redraw_cycle = 0;
+			redraw_guru_con();
+		}
+		TCODConsole::blit(&guru_con, 0, 0, 41, 7, TCODConsole::root, (TCODConsole::root->getWidth() / 2) - 20, (TCODConsole::root->getHeight() / 2) - 3);
+		TCODConsole::flush();
+		TCODSystem::checkForEvent(TCOD_EVENT_KEY_PRESS, &keypress, nullptr);
+		TCODSystem::sleepMilli(10);
+	}
+#endif
+
+#ifndef GURU_USING_CONSOLE
+#ifndef GURU_USING_CURSES
+	exit(EXIT_FAILURE);
+#endif
+#endif
+}
+
+// As above, but with an exception instead of a string.
+void halt(std::exception &e)
+{
+#ifdef GURU_USING_STACK_TRACE
+	stack_trace();
+#endif
+	guru::halt(e.what());
+}
+
+// Catches a segfault or other fatal signal.
+void intercept_signal(int sig)
+{
+#ifdef GURU_USING_STACK_TRACE
+	stack_trace();
+#endif
+	const char *sig_type;
+	switch(sig)
+	{
+		case SIGABRT: sig_type = "Software requested abort."; break;
+		case SIGFPE: sig_type = "Floating-point exception."; break;
+		case SIGILL: sig_type = "Illegal instruction."; break;
+		case SIGSEGV: sig_type = "Segmentation fault."; break;
+		default: sig_type = "Intercepted unknown signal."; break;
+	}
+
+#ifdef GURU_POSIX
+	// halt() isn't safe to call from a signal handler, so write what we can to the log the safe way, then let the signal kill the process as it normally would.
+	// If the crash handler itself crashes, the second signal goes straight through.
+	if (!crash_in_progress && syslog_ready.load())
+	{
+		crash_in_progress = 1;
+		crash_dump(sig_type);
+	}
+	signal(sig, SIG_DFL);
+	raise(sig);
+#else
+	// Disable the signals for now, to stop a cascade.
+	signal(SIGABRT, SIG_IGN);
+	signal(SIGSEGV, SIG_IGN);
+	signal(SIGILL, SIG_IGN);
+	signal(SIGFPE, SIG_IGN);
+	halt(sig_type);
+#endif
+}
+
+// Logs a record built by logf(), formatting it straight away or handing it to the background writer.
+void logf_record(int type, const LogfRecord &record)
+{
+	if (flight_recorder.load(std::memory_order_relaxed)) record_flight(std::string_view(record.data, record.size), type, true);
+	if (type >= min_log_level.load(std::memory_order_relaxed)) enqueue_record(std::string_view(record.data, record.size), type, true, 0);
+}
+
+// Returns the format string of a LogfRecord.
+const char* logf_format(std::string_view record)
+{
+	if (record.size() < 1 + sizeof(void*)) return "";
+	if (record[0] == 'c')
+	{
+		const CallSite *site;
+		memcpy(&site, record.data() + 1, sizeof(site));
+		return site->format;
+	}
+	const char *format;
+	memcpy(&format, record.data() + 1, sizeof(format));
+	return format;
+}
+
+// Logs a record built by GURU_LOGF(), registering its call site first if it hasn't been seen before.
+void logf_site_record(CallSite &site, const LogfRecord &record)
+{
+	if (flight_recorder.load(std::memory_order_relaxed)) record_flight(std::string_view(record.data, record.size), site.type, true);
+	if (site.type < min_log_level.load(std::memory_order_relaxed)) return;
+	uint32_t id = site.id.load(std::memory_order_acquire);
+	if (GURU_UNLIKELY(!id)) id = register_site(site);
+	site.count.fetch_add(1, std::memory_order_relaxed);
+	enqueue_record(std::string_view(record.data, record.size), site.type, true, id);
+}
+
+#ifdef GURU_USING_FUNCTION_TIMING
+// Logs the number of calls to each stack_trace() function, and the time spent in it, across all threads. Also done by close_syslog().
+void log_function_timing()
+{
+	struct Totals { uint64_t calls = 0, inclusive = 0, exclusive = 0; };
+	std::map<std::string, Totals> totals;	// By name, as an inline function can have a copy of its name in each file that uses it.
+	uint64_t dropped = 0;
+	for (TimingTable *table = timing_tables.load(std::memory_order_acquire); table; table = table->next)
+	{
+		for (const FunctionTiming &timing : table->functions)
+		{
+			const char *function = timing.function.load(std::memory_order_acquire);
+			if (!function) continue;
+			Totals &total = totals[function];
+			total.calls += timing.calls.load(std::memory_order_relaxed);
+			total.inclusive += timing.inclusive.load(std::memory_order_relaxed);
+			total.exclusive += timing.exclusive.load(std::memory_order_relaxed);
+		}
+		dropped += table->dropped.load(std::memory_order_relaxed);
+	}
+	if (totals.empty()) return;
+
+	std::vector<std::pair<const std::string*, const Totals*>> sorted;
+	for (const auto &total : totals)
+		sorted.push_back({&total.first, &total.second});
+	std::sort(sorted.begin(), sorted.end(), [](const std::pair<const std::string*, const Totals*> &a, const std::pair<const std::string*, const Totals*> &b) { return a.second->exclusive > b.second->exclusive; });
+	const double ms_per_tick = timing_tick_ns() / 1000000;
+	log("Function timing (calls, inclusive ms, exclusive ms), busiest first:");
+	char line[1024];
+	for (const auto &total : sorted)
+	{
+		const int size = snprintf(line, sizeof(line), "%llu, %.3f, %.3f: %s", static_cast<unsigned long long>(total.second->calls), total.second->inclusive * ms_per_tick,
+			total.second->exclusive * ms_per_tick, total.first->c_str());
+		log(std::string_view(line, size < static_cast<int>(sizeof(line)) ? size : sizeof(line) - 1));
+	}
+	if (dropped) log(std::to_string(dropped) + " calls weren't timed, as there were too many different functions.");
+}
+#endif
+
+// Logs how many times each GURU_LOGF() call site was used, busiest first.
+void log_site_statistics()
+{
+	std::vector<std::pair<uint64_t, const CallSite*>> counts;
+	{
+		WriterLock writer_lock;
+		for (const CallSite *site : call_sites)
+		{
+			const uint64_t count = site->count.load(std::memory_order_relaxed);
+			if (count) counts.push_back({count, site});
+		}
+	}
+	if (counts.empty()) return;
+	std::sort(counts.begin(), counts.end(), [](const std::pair<uint64_t, const CallSite*> &a, const std::pair<uint64_t, const CallSite*> &b) { return a.first > b.first; });
+	log("Call-site statistics:");
+	char line[512];
+	for (const auto &count : counts)
+	{
+		const char *filename = strrchr(count.second->file, '/');
+		const int size = snprintf(line, sizeof(line), "%s:%d (%s): %llu", filename ? filename + 1 : count.second->file, count.second->line, count.second->function,
+			static_cast<unsigned long long>(count.first));
+		log(std::string_view(line, size < static_cast<int>(sizeof(line)) ? size : sizeof(line) - 1));
+	}
+}
+
+#ifdef GURU_USING_STACK_TRACE
+// Logs a stack trace taken with capture_trace().
+void log_trace(const TraceSnapshot &trace)
+{
+	if (!trace.count) return;
+	log("Stack trace follows:", GURU_STACK);
+	if (trace.depth > GURU_STACK_DEPTH) log(std::to_string(trace.depth - GURU_STACK_DEPTH) + " deeper frames were not recorded.", GURU_STACK);
+	const size_t first = std::min<size_t>(trace.depth, GURU_STACK_DEPTH) - trace.count;	// The index in the full stack of the outermost frame copied.
+	char line[1024];
+	for (size_t i = trace.count; i > 0; i--)
+		log(std::string_view(line, format_stack_frame(first + i - 1, *trace.frames[i - 1], line, sizeof(line))), GURU_STACK);
+	if (first) log(std::to_string(first) + " outer frames were not captured.", GURU_STACK);
+}
+#endif
+
+// Logs a message in the system log file, once log_enabled() has said it's wanted.
+void log_unfiltered(std::string_view msg, int type)
+{
+	if (flight_recorder.load(std::memory_order_relaxed)) record_flight(msg, type, false);
+	if (type >= min_log_level.load(std::memory_order_relaxed)) enqueue_record(msg, type, false, 0);	// With the flight recorder running, lower severities get this far just to be recorded.
+}
+
+// Unmaps the log file and trims off any unused preallocated space.
+void mmap_close()
+{
+#ifdef GURU_POSIX
+	if (!mmap_data) return;
+	munmap(mmap_data, mmap_size);
+	if (ftruncate(mmap_fd, mmap_used)) { }	// Nothing useful can be done about this failing, other than leave the padding there.
+	close(mmap_fd);
+	mmap_data = nullptr;
+	mmap_fd = -1;
+	mmap_size = mmap_used = 0;
+#endif
+}
+
+// Extends the mapped log file by another chunk. Returns false if this failed.
+bool mmap_grow()
+{
+#ifdef GURU_POSIX
+	const size_t new_size = mmap_size + MMAP_CHUNK_SIZE;
+#ifdef __linux__
+	// Actually allocate the disk space, so running out of space is reported here rather than as a SIGBUS when writing to the mapping.
+	if (posix_fallocate(mmap_fd, 0, new_size)) return false;
+#else
+	if (ftruncate(mmap_fd, new_size)) return false;
+#endif
+	void *new_data = mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, mmap_fd, 0);
+	if (new_data == MAP_FAILED) return false;
+	if (mmap_data) munmap(mmap_data, mmap_size);
+	mmap_data = static_cast<char*>(new_data);
+	mmap_size = new_size;
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Opens the log file as a memory-mapped file. Returns false if this isn't possible.
+bool mmap_open(const std::string &filename)
+{
+#ifdef GURU_POSIX
+	mmap_fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (mmap_fd < 0) return false;
+	mmap_size = mmap_used = 0;
+	if (mmap_grow()) return true;
+	close(mmap_fd);
+	mmap_fd = -1;
+#else
+	(void)filename;
+#endif
+	return false;
+}
+
+// Reports a non-fatal error, which will be logged but will not halt execution unless it cascades.
+void nonfatal(std::string_view error, int type)
+{
+	if (cascade_failure) return;
+#ifdef GURU_USING_STACK_TRACE
+	stack_trace();
+#endif
+
+	unsigned int cascade_weight = 0;
+	switch(type)
+	{
+		case GURU_WARN: cascade_weight = CASCADE_WEIGHT_WARNING; break;
+		case GURU_ERROR: cascade_weight = CASCADE_WEIGHT_ERROR; break;
+		case GURU_CRITICAL: cascade_weight = CASCADE_WEIGHT_CRITICAL; break;
+		default: nonfatal("Nonfatal error reported with incorrect severity specified.", GURU_WARN); break;
+	}
+
+	guru::log(error, type);
+#ifdef GURU_USING_STACK_TRACE
+	if (type >= GURU_ERROR && (syslog_options & GURU_NONFATAL_TRACE) && log_enabled(GURU_STACK)) log_trace(capture_trace());
+#endif
+
+	if (cascade_weight)
+	{
+		bool cascading = false;
+		{
+			std::lock_guard<std::mutex> lock(cascade_mutex);
+			std::chrono::duration<float> elapsed_seconds = std::chrono::steady_clock::now() - cascade_timer;
+			if (elapsed_seconds.count() <= CASCADE_TIMEOUT)
+			{
+				cascade_count += cascade_weight;
+				cascading = (cascade_count > CASCADE_THRESHOLD);
+			}
+			else
+			{
+				cascade_timer = std::chrono::steady_clock::now();
+				cascade_count = 0;
+			}
+		}
+		if (cascading && !cascade_failure.exchange(true)) guru::halt("Cascade failure detected!");	// Only one thread gets to halt.
+	}
+}
+
+// Opens the log file to be written through syslog_buffer, rather than mapped. Returns false if this failed.
+bool open_plain_file(const std::string &filename, bool append)
+{
+	syslog_buffered = 0;
+#ifdef GURU_POSIX
+	syslog_fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+	return syslog_fd >= 0;
+#else
+	syslog.open(filename.c_str(), (binary_log || append ? std::ios::binary : std::ios::openmode()) | (append ? std::ios::app : std::ios::out));
+	return syslog.is_open();
+#endif
+}
+
+// Opens the output log for messages.
+void open_syslog(std::string_view filename, unsigned int options)
+{
+	if (!filename.size()) filename = FILENAME_LOG;
+	WriterLock writer_lock;
+	syslog_filename = filename;
+	syslog_options = options;
+	flush_policy = options & (GURU_FLUSH_SIZE | GURU_FLUSH_INTERVAL | GURU_FLUSH_SEVERITY);
+	binary_log = (options & GURU_BINARY);
+	rotate_log = (options & GURU_ROTATE);
+	calibrate_clock(options);
+	segment_start = wall_clock_now();
+	{
+		std::lock_guard<std::mutex> lock(rotate_mutex);
+		rotate_stop = false;
+	}
+
+	// When rotating, the last run's log file is kept as the newest old log, rather than deleted.
+	const std::string rotated = syslog_filename + "." + std::to_string(segment_start) + ".old";
+	if (rotate_log && !rename(syslog_filename.c_str(), rotated.c_str())) queue_rotated_log(rotated);
+	else remove(syslog_filename.c_str());
+	register_section_sites();
+	open_syslog_file(syslog_filename);
+	if (binary_log && syslog_is_open()) for (Sink *sink : sinks) write_binary_header(sink);	// Sinks added before the log was opened.
+	flight_recorder.store(options & GURU_FLIGHT_RECORDER);
+	capture_level.store(flight_recorder.load() ? GURU_INFO : min_log_level.load());
+	syslog_ready.store(syslog_is_open(), std::memory_order_release);
+	if ((options & GURU_ASYNC) && syslog_ready.load()) start_async_writer();
+#ifdef GURU_SAMPLING_PROFILER
+	if (options & GURU_PROFILE) start_profiler();
+#endif
 	log("Guru error-handling system is online. Hooking signals...");
 	if (signal(SIGABRT, intercept_signal) == SIG_ERR) halt("Failed to hook abort signal.");
 	if (signal(SIGSEGV, intercept_signal) == SIG_ERR) halt("Failed to hook segfault signal.");
 	if (signal(SIGILL, intercept_signal) == SIG_ERR) halt("Failed to hook illegal instruction signal.");
 	if (signal(SIGFPE, intercept_signal) == SIG_ERR) halt("Failed to hook floating-point exception signal.");
-	cascade_timer = std::chrono::system_clock::now();
+	std::lock_guard<std::mutex> lock(cascade_mutex);
+	cascade_timer = std::chrono::steady_clock::now();
+	cascade_count = 0;
+}
+
+// Opens a new log file in the way the open_syslog() options ask for, and writes its header if it needs one. The caller must hold a WriterLock.
+void open_syslog_file(const std::string &filename)
+{
+	if (!(syslog_options & GURU_MMAP) || !mmap_open(filename))
+	{
+		open_plain_file(filename, false);
+	}
+	crash_utc_offset = utc_offset();
+	flush_pending = 0;
+	flush_timer = std::chrono::steady_clock::now();
+	segment_size = 0;
+	if (binary_log && syslog_is_open()) write_binary_header(nullptr);
+}
+
+#ifdef GURU_SAMPLING_PROFILER
+// The SIGPROF handler: counts a sample of the running thread's stack in the profile table.
+void profile_sample(int)
+{
+	// Both sequentially consistent, to pair with stop_profiler(), which clears the table and then waits for profile_busy: either it sees this handler as busy, or this handler sees the cleared table.
+	profile_busy.fetch_add(1);
+	ProfileSlot *slots = profile_slots.load();
+	const unsigned int depth = StackTrace::depth;
+	if (slots && !depth) profile_untraced.fetch_add(1, std::memory_order_relaxed);
+	else if (slots)
+	{
+		// This runs on the thread being sampled, and the signal fences in StackTrace make sure every frame below the depth has been stored.
+		const unsigned int recorded = std::min<unsigned int>(depth, GURU_STACK_DEPTH);
+		const unsigned int first = (recorded > PROFILE_DEPTH ? recorded - PROFILE_DEPTH : 0);
+		const bool truncated = (depth > recorded || first);
+		const StackFrame *frames[PROFILE_DEPTH];
+		unsigned int count = 0;
+		uint64_t hash = (truncated ? 1 : 0) ^ 14695981039346656037ULL;
+		for (unsigned int i = first; i < recorded; i++)
+		{
+			frames[count++] = StackTrace::frames[i];
+			hash = (hash ^ reinterpret_cast<uintptr_t>(StackTrace::frames[i])) * 1099511628211ULL;
+		}
+		if (!hash) hash = 1;
+
+		bool counted = false;
+		for (size_t probe = 0; probe < PROFILE_TABLE_SIZE && !counted; probe++)
+		{
+			ProfileSlot &slot = slots[(hash + probe) & (PROFILE_TABLE_SIZE - 1)];
+			uint64_t existing = slot.hash.load(std::memory_order_acquire);
+			if (!existing && slot.hash.compare_exchange_strong(existing, hash, std::memory_order_acq_rel))
+			{
+				slot.truncated = truncated;
+				slot.count = count;
+				memcpy(slot.frames, frames, count * sizeof(frames[0]));
+				slot.ready.store(true, std::memory_order_release);
+				existing = hash;
+			}
+			if (existing != hash) continue;
+			slot.samples.fetch_add(1, std::memory_order_relaxed);
+			counted = true;
+		}
+		if (!counted) profile_dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+	profile_busy.fetch_sub(1, std::memory_order_release);
+}
+#endif
+
+// Hands a rotated log file to the compressor, starting it if needed.
+void queue_rotated_log(const std::string &filename)
+{
+	static bool exit_hooked = false;
+	std::unique_lock<std::mutex> lock(rotate_mutex);
+	if (rotate_stop)	// The compressor has already been shut down, so the program is exiting. Just do it here.
+	{
+		lock.unlock();
+		archive_log({filename, syslog_filename});
+		return;
+	}
+	rotate_queue.push_back({filename, syslog_filename});
+	if (!rotate_thread.joinable()) rotate_thread = std::thread(rotate_worker);
+	lock.unlock();
+	rotate_wake.notify_one();
+
+	// Make sure the thread is finished with before the program exits, even without close_syslog().
+	if (!exit_hooked && !atexit(stop_rotate_worker)) exit_hooked = true;
+}
+
+// Copies a record into the flight recorder.
+void record_flight(std::string_view msg, int type, bool deferred)
+{
+	const uint64_t index = flight_next.fetch_add(1, std::memory_order_relaxed);
+	FlightRecord &flight = flight_records[index & (FLIGHT_RECORDER_SIZE - 1)];
+
+	// Claim the slot before writing to it. If another thread is still writing an older record there, or has already put a newer one there, this record is dropped instead.
+	uint64_t stamp = flight.stamp.load(std::memory_order_relaxed);
+	do
+	{
+		if (stamp == FLIGHT_RECORD_BUSY || stamp > index) return;
+	} while (!flight.stamp.compare_exchange_weak(stamp, FLIGHT_RECORD_BUSY, std::memory_order_acquire, std::memory_order_relaxed));
+	std::atomic_thread_fence(std::memory_order_release);
+	flight.when = timestamp_now();
+	flight.thread = this_thread_buffer()->thread_id;
+	flight.type = type;
+	flight.deferred = deferred;
+	flight.size = static_cast<uint32_t>(msg.size() < sizeof(flight.data) ? msg.size() : sizeof(flight.data));
+	memcpy(flight.data, msg.data(), flight.size);
+	flight.stamp.store(index + 1, std::memory_order_release);
+}
+
+#ifdef GURU_USING_FUNCTION_TIMING
+// Adds a call to a function's timing, in this thread's table.
+void record_function_time(const char *function, uint64_t inclusive, uint64_t exclusive)
+{
+	TimingTable *table = timing_table;
+	if (GURU_UNLIKELY(!table))
+	{
+		table = timing_table = new TimingTable;
+		table->next = timing_tables.load(std::memory_order_relaxed);
+		while (!timing_tables.compare_exchange_weak(table->next, table, std::memory_order_release, std::memory_order_relaxed)) { }
+	}
+
+	// Only this thread writes to its table, so plain loads and stores are enough; they're atomic just so log_function_timing() can read them safely.
+	const size_t hash = static_cast<size_t>((reinterpret_cast<uintptr_t>(function) >> 3) * 0x9e3779b97f4a7c15ULL);
+	for (size_t probe = 0; probe < TIMING_TABLE_SIZE; probe++)
+	{
+		FunctionTiming &timing = table->functions[(hash + probe) & (TIMING_TABLE_SIZE - 1)];
+		const char *existing = timing.function.load(std::memory_order_relaxed);
+		if (!existing) timing.function.store(existing = function, std::memory_order_release);
+		if (existing != function) continue;
+		timing.calls.store(timing.calls.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		timing.inclusive.store(timing.inclusive.load(std::memory_order_relaxed) + inclusive, std::memory_order_relaxed);
+		timing.exclusive.store(timing.exclusive.load(std::memory_order_relaxed) + exclusive, std::memory_order_relaxed);
+		return;
+	}
+	table->dropped.store(table->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+#endif
+
+// Checks if any thread has records waiting to be written.
+bool records_pending()
+{
+	for (ThreadBuffer *buffer = thread_buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next)
+		if (buffer->head.load(std::memory_order_acquire) != buffer->tail.load(std::memory_order_acquire)) return true;
+	return false;
+}
+
+// Stops sending log output to a sink added with add_sink().
+void remove_sink(Sink *sink)
+{
+	WriterLock writer_lock;
+	for (size_t i = 0; i < sinks.size(); i++)
+	{
+		if (sinks.at(i) != sink) continue;
+		sink->flush();
+		sinks.erase(sinks.begin() + i);
+		return;
+	}
+}
+
+// Registers every GURU_LOGF() call site in the guru_sites linker section.
+void register_section_sites()
+{
+#if defined(__clang__) && defined(__ELF__)
+	if (!__start_guru_sites || !__stop_guru_sites) return;
+	for (CallSite *site = __start_guru_sites; site < __stop_guru_sites; site++)
+		if (!site->id.load(std::memory_order_relaxed)) register_site(*site);
+#endif
+}
+
+// Gives a GURU_LOGF() call site its ID, and defines it in the binary log. Returns the ID.
+uint32_t register_site(CallSite &site)
+{
+	WriterLock writer_lock;
+	uint32_t id = site.id.load(std::memory_order_relaxed);
+	if (id) return id;	// Another thread got here first.
+	call_sites.push_back(&site);
+	id = static_cast<uint32_t>(call_sites.size());
+	site.id.store(id, std::memory_order_release);
+	if (binary_log && syslog_is_open())
+	{
+		write_site_definition(site, nullptr);
+		for (Sink *sink : sinks) write_site_definition(site, sink);
+	}
+	return id;
+}
+
+// Logs the counts of messages suppressed by rate-limited call sites, once they're a second old, or straight away if force is set.
+void report_rate_limits(bool force)
+{
+	thread_local bool reporting = false;	// The reports are logged, which can bring us back here.
+	if (!rate_limits_pending.load(std::memory_order_relaxed) || reporting) return;
+	reporting = true;
+	const int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	for (RateLimit *limit = rate_limits.load(std::memory_order_acquire); limit; limit = limit->next)
+		limit->report_suppressed(now, force);
+	reporting = false;
+}
+
+// Moves the current log file out of the way and starts a new one. The caller must hold a WriterLock.
+void rotate_syslog(int64_t when)
+{
+	const std::string rotated = syslog_filename + "." + std::to_string(when) + ".old";
+	close_syslog_file();
+	segment_start = when;
+	bool replaced = false;
+#ifdef GURU_POSIX
+	// Anyone reading the log always finds a complete file under its usual name: the old file gets a second name to be archived under,
+	// then the new file is started under a temporary name and renamed over the top of the old one in a single step.
+	if (!link(syslog_filename.c_str(), rotated.c_str()))
+	{
+		const std::string fresh = syslog_filename + ".new";
+		open_syslog_file(fresh);
+		replaced = !rename(fresh.c_str(), syslog_filename.c_str());
+		if (replaced) queue_rotated_log(rotated);
+		else
+		{
+			close_syslog_file();
+			remove(fresh.c_str());
+			remove(rotated.c_str());
+		}
+	}
+#endif
+	if (!replaced)	// Without link(), the log file briefly disappears between being moved out of the way and the new one being created.
+	{
+		if (!rename(syslog_filename.c_str(), rotated.c_str())) queue_rotated_log(rotated);
+		open_syslog_file(syslog_filename);
+	}
+}
+
+// The background compressor thread's main loop.
+void rotate_worker()
+{
+	std::unique_lock<std::mutex> lock(rotate_mutex);
+	while (true)
+	{
+		rotate_wake.wait(lock, [] { return rotate_stop || !rotate_queue.empty(); });
+		if (rotate_queue.empty()) break;
+		const RotatedLog rotated = rotate_queue.front();
+		rotate_queue.erase(rotate_queue.begin());
+		lock.unlock();
+		archive_log(rotated);
+		lock.lock();
+	}
+}
+
+// Sets the lowest severity that will be logged, from GURU_INFO to GURU_CRITICAL. Critical errors are always logged, so halt() can't be silenced.
+void set_log_level(int type)
+{
+	if (type < GURU_INFO) type = GURU_INFO;
+	else if (type > GURU_CRITICAL) type = GURU_CRITICAL;
+	min_log_level.store(type, std::memory_order_relaxed);
+	capture_level.store(flight_recorder.load() ? GURU_INFO : type, std::memory_order_relaxed);
+}
+
+// Starts the background writer thread.
+void start_async_writer()
+{
+	static bool exit_hooked = false;
+	if (async_active.load()) return;
+	async_stop.store(false);
+	async_thread = std::thread(async_writer);
+	async_active.store(true, std::memory_order_release);
+
+	// Make sure the queue gets written out even if the program exits without calling close_syslog().
+	if (!exit_hooked && !atexit(stop_async_writer)) exit_hooked = true;
+}
+
+#ifdef GURU_SAMPLING_PROFILER
+// Allocates the profile table and starts the SIGPROF timer.
+void start_profiler()
+{
+	if (profile_slots.load()) return;
+	profile_untraced.store(0);
+	profile_dropped.store(0);
+	profile_slots.store(new ProfileSlot[PROFILE_TABLE_SIZE]);
+
+	// SA_RESTART restarts most of the program's own system calls when a sample interrupts them, but not all: poll(), epoll_wait(), select(), nanosleep() and similar calls still fail with EINTR, as with any other signal.
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = profile_sample;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	const itimerval timer = { {0, PROFILE_INTERVAL_US}, {0, PROFILE_INTERVAL_US} };
+	if (sigaction(SIGPROF, &action, &profile_old_action))
+	{
+		delete[] profile_slots.exchange(nullptr);
+		nonfatal("Could not start the sampling profiler.", GURU_WARN);
+	}
+	else if (setitimer(ITIMER_PROF, &timer, &profile_old_timer))
+	{
+		sigaction(SIGPROF, &profile_old_action, nullptr);
+		delete[] profile_slots.exchange(nullptr);
+		nonfatal("Could not start the sampling profiler.", GURU_WARN);
+	}
+}
+#endif
+
+// Drains the background writer's queue, then stops the thread. Further log() calls will be written synchronously.
+void stop_async_writer()
+{
+	if (!async_active.exchange(false)) return;
+	async_stop.store(true);
+	if (async_thread.get_id() == std::this_thread::get_id()) async_thread.detach();	// The writer itself has crashed, so it can't wait for itself to finish.
+	else
+	{
+		async_wake.notify_one();
+		async_thread.join();
+	}
+	WriterLock writer_lock;
+	drain_thread_buffers();	// Pick up anything that arrived after the writer's last pass.
+}
+
+#ifdef GURU_SAMPLING_PROFILER
+// Stops the SIGPROF timer, and writes the profile out as folded stacks.
+void stop_profiler()
+{
+	ProfileSlot *slots = profile_slots.load();
+	if (!slots) return;
+	const itimerval off = { {0, 0}, {0, 0} };
+	setitimer(ITIMER_PROF, &off, nullptr);
+	signal(SIGPROF, SIG_IGN);	// Not SIG_DFL, which would kill the process if a last signal was still on its way.
+	profile_slots.store(nullptr);
+	while (profile_busy.load()) std::this_thread::yield();
+	sigaction(SIGPROF, &profile_old_action, nullptr);	// Hand SIGPROF back to whatever the program had set up, and its timer with it.
+	setitimer(ITIMER_PROF, &profile_old_timer, nullptr);
+
+	// Different descriptors can be in the same function, so the stacks are merged by name. Semicolons separate frames, so they can't appear in the names.
+	std::map<std::string, uint64_t> folded;
+	uint64_t total = profile_untraced.load() + profile_dropped.load();
+	for (size_t i = 0; i < PROFILE_TABLE_SIZE; i++)
+	{
+		const ProfileSlot &slot = slots[i];
+		if (!slot.ready.load(std::memory_order_acquire)) continue;
+		std::string stack = (slot.truncated ? "[truncated]" : "");
+		for (unsigned int f = 0; f < slot.count; f++)
+		{
+			if (!stack.empty()) stack += ';';
+			std::string name = slot.frames[f]->function;
+			std::replace(name.begin(), name.end(), ';', ',');
+			stack += name;
+		}
+		const uint64_t samples = slot.samples.load(std::memory_order_relaxed);
+		folded[stack] += samples;
+		total += samples;
+	}
+	if (profile_untraced.load()) folded["[untraced]"] += profile_untraced.load();
+	if (profile_dropped.load()) folded["[dropped]"] += profile_dropped.load();
+	delete[] slots;
+
+	const std::string filename = syslog_filename + ".folded";
+	std::ofstream out(filename.c_str());
+	for (const auto &stack : folded)
+		out << stack.first << ' ' << stack.second << '\n';
+	out.close();
+	if (out.fail()) nonfatal("Could not write the profile to " + filename, GURU_WARN);
+	else log("Profile of " + std::to_string(total) + " samples written to " + filename);
+}
+#endif
+
+// Waits for the compressor to finish its queue, then stops the thread.
+void stop_rotate_worker()
+{
+	{
+		std::lock_guard<std::mutex> lock(rotate_mutex);
+		rotate_stop = true;
+	}
+	rotate_wake.notify_one();
+	if (rotate_thread.joinable()) rotate_thread.join();
+}
+
+// Checks if the log file is open, whichever way it's being written.
+bool syslog_is_open()
+{
+#ifdef GURU_POSIX
+	return mmap_data || syslog_fd >= 0;
+#else
+	return mmap_data || syslog.is_open();
+#endif
+}
+
+// Returns this thread's buffer, claiming or creating one if needed.
+ThreadBuffer* this_thread_buffer()
+{
+	if (thread_buffer) return thread_buffer;
+
+	// Reuse a buffer left behind by a thread that's exited, if there is one. Any records still waiting in it will be written as normal.
+	ThreadBuffer *buffer;
+	for (buffer = thread_buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next)
+	{
+		bool in_use = false;
+		if (buffer->in_use.compare_exchange_strong(in_use, true, std::memory_order_acquire)) break;
+	}
+	if (!buffer)
+	{
+		buffer = new ThreadBuffer;
+		buffer->next = thread_buffers.load(std::memory_order_relaxed);
+		while (!thread_buffers.compare_exchange_weak(buffer->next, buffer, std::memory_order_release, std::memory_order_relaxed)) { }
+	}
+	buffer->thread_id = next_thread_id.fetch_add(1, std::memory_order_relaxed);
+	thread_buffer = buffer;
+	thread_buffer_owner.buffer = buffer;
+	return buffer;
+}
+
+// Reads the clock chosen with the GURU_CLOCK options. Use wall_time() to turn this into a real time.
+int64_t timestamp_now()
+{
+	switch(clock_source.load(std::memory_order_relaxed))
+	{
+#ifdef GURU_TSC
+		case GURU_CLOCK_TSC: return static_cast<int64_t>(__rdtsc());
+#endif
+#ifdef CLOCK_MONOTONIC_COARSE
+		case GURU_CLOCK_COARSE:
+		{
+			timespec now;
+			clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+			return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+		}
+#endif
+		default: return wall_clock_now();
+	}
+}
+
+#ifdef GURU_USING_FUNCTION_TIMING
+// Returns how many nanoseconds each tick of timing_ticks() is, measuring it the first time.
+double timing_tick_ns()
+{
+#ifdef GURU_TIMING_TSC
+	static const double scale = []
+	{
+		const auto start = std::chrono::steady_clock::now();
+		const uint64_t start_ticks = timing_ticks();
+		std::this_thread::sleep_for(std::chrono::milliseconds(CLOCK_CALIBRATION_MS));
+		const auto end = std::chrono::steady_clock::now();
+		const uint64_t end_ticks = timing_ticks();
+		return (end_ticks > start_ticks ? std::chrono::duration<double, std::nano>(end - start).count() / (end_ticks - start_ticks) : 1.0);
+	}();
+	return scale;
+#else
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::duration(1)).count();
+#endif
+}
+#endif
+
+// Returns the local time's current offset from UTC, in seconds.
+int32_t utc_offset()
+{
+	const time_t now = time(nullptr);
+	tm local, utc;
+#ifdef _WIN32
+	localtime_s(&local, &now);
+	gmtime_s(&utc, &now);
+#else
+	localtime_r(&now, &local);
+	gmtime_r(&now, &utc);
+#endif
+	int day_diff = local.tm_yday - utc.tm_yday;
+	if (day_diff > 1) day_diff = -1;		// Wrapped around the end of the year.
+	else if (day_diff < -1) day_diff = 1;
+	return day_diff * 86400 + (local.tm_hour - utc.tm_hour) * 3600 + (local.tm_min - utc.tm_min) * 60;
+}
+
+// Returns the current time, in nanoseconds since the Unix epoch.
+int64_t wall_clock_now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Turns a reading from timestamp_now() into nanoseconds since the Unix epoch. Safe to call from the crash handler.
+int64_t wall_time(int64_t timestamp)
+{
+	if (!clock_source.load(std::memory_order_relaxed)) return timestamp;
+	return clock_base_wall + static_cast<int64_t>((timestamp - clock_base) * clock_scale);
+}
+
+// Writes the binary log's file header and every call site's definition, to the log file or, if one is given, only to a sink. The caller must hold a WriterLock.
+void write_binary_header(Sink *sink)
+{
+	char header[GURU_BINARY_HEADER_SIZE] = GURU_BINARY_MAGIC;
+	header[4] = GURU_BINARY_VERSION;
+	const int32_t offset = utc_offset();
+	memcpy(header + 8, &offset, sizeof(offset));
+	if (sink) sink->write(header, sizeof(header), GURU_INFO);
+	else write_syslog(header, sizeof(header));
+	for (const CallSite *site : call_sites) write_site_definition(*site, sink);
+}
+
+// Writes a log record to the file, unless it's a repeat of a recent message.
+void write_log_line(std::string_view msg, const LogRecord &record)
+{
+	// Critical errors (including the halt and crash banners) and stack traces are always written in full.
+	if (record.type > GURU_ERROR)
+	{
+		write_repeat_summaries(record.when);
+		write_log_record(msg, record);
+		return;
+	}
+
+	const uint64_t hash = hash_message(msg, record.type);
+	for (RecentMessage &recent : recent_messages)
+	{
+		if (recent.used && recent.hash == hash)
+		{
+			if (recent_repeats < DEDUP_REPLAY) recent_repeat_order[recent_repeats] = static_cast<size_t>(&recent - recent_messages);
+			recent_repeats++;
+			recent.repeats++;
+			return;
+		}
+	}
+
+	// Something new has turned up, so any runs of repeats are over.
+	write_repeat_summaries(record.when);
+	RecentMessage &recent = recent_messages[recent_messages_next];
+	recent_messages_next = (recent_messages_next + 1) % DEDUP_WINDOW;
+	recent.used = true;
+	recent.hash = hash;
+	recent.repeats = 0;
+	recent.type = record.type;
+	recent.thread = record.thread;
+	const std::string_view quote = (binary_log && record.site) ? std::string_view(logf_format(msg)) : msg;	// The arguments of a binary GURU_LOGF() record aren't worth quoting.
+	recent.length = quote.size() < DEDUP_SUMMARY_LENGTH ? quote.size() : DEDUP_SUMMARY_LENGTH;
+	recent.complete = (quote.data() == msg.data() && recent.length == msg.size());
+	memcpy(recent.text, quote.data(), recent.length);
+	write_log_record(msg, record);
+	recent_last_written = true;
+}
+
+// Formats a log record and writes it to the file.
+void write_log_record(std::string_view msg, const LogRecord &record)
+{
+	recent_last_written = false;	// Set again by write_log_line() if this is a line it's keeping in the window.
+	const int64_t when = wall_time(record.when);
+	log_line.clear();
+	if (binary_log)
+	{
+		const uint8_t type_byte = static_cast<uint8_t>(record.type);
+		if (record.site) msg.remove_prefix(1 + sizeof(void*));	// Just the arguments; the format string is in the call site's definition.
+		const uint32_t size = static_cast<uint32_t>(msg.size());
+		log_line.append(reinterpret_cast<const char*>(&when), sizeof(when));
+		log_line.append(reinterpret_cast<const char*>(&type_byte), sizeof(type_byte));
+		log_line.append(reinterpret_cast<const char*>(&record.site), sizeof(record.site));
+		log_line.append(reinterpret_cast<const char*>(&record.thread), sizeof(record.thread));
+		log_line.append(reinterpret_cast<const char*>(&record.sequence), sizeof(record.sequence));
+		log_line.append(reinterpret_cast<const char*>(&size), sizeof(size));
+		log_line.append(msg);
+	}
+	else
+	{
+		std::string_view txt_tag;
+		switch(record.type)
+		{
+			case GURU_INFO:
+#ifdef GURU_USING_STACK_TRACE
+			case GURU_STACK:
+#endif
+				break;
+			case GURU_WARN: txt_tag = "[WARN] "; break;
+			case GURU_ERROR: txt_tag = "[ERROR] "; break;
+			case GURU_CRITICAL: txt_tag = "[CRITICAL] "; break;
+		}
+		log_line.append("[").append(format_time(when)).append("] ");
+		if (record.thread > 1)	// Lines from the first thread to log anything, usually the main thread, aren't tagged.
+		{
+			char thread_tag[16];
+			log_line.append(thread_tag, snprintf(thread_tag, sizeof(thread_tag), "[T%u] ", static_cast<unsigned int>(record.thread)));
+		}
+		log_line.append(txt_tag).append(msg).append("\n");
+	}
+	write_syslog(log_line.data(), log_line.size());
+	for (Sink *sink : sinks) sink->write(log_line.data(), log_line.size(), record.type);
+	flush_syslog_if_due(record.type);
+	if (rotate_log && ((ROTATE_MAX_BYTES && segment_size >= ROTATE_MAX_BYTES) || (ROTATE_MAX_AGE && when - segment_start >= ROTATE_MAX_AGE * INT64_C(1000000000))))
+		rotate_syslog(when);
+}
+
+// Writes out waiting records, unless another thread is already doing so, in which case it'll pick them up instead.
+void write_pending_records()
+{
+	do
+	{
+		// The fences make sure that either we see records added while the other writer was finishing up, or it sees them before letting go of the lock.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		{
+			WriterLock writer_lock(false);
+			if (!writer_lock.locked) return;
+			drain_thread_buffers();
+		}
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	} while (records_pending());
+	report_rate_limits(false);
+}
+
+WriterLock::WriterLock(bool wait) : locked(true)
+{
+	if (writer_depth++) return;
+	while (writer_busy.exchange(true, std::memory_order_acquire))
+	{
+		if (!wait)
+		{
+			writer_depth--;
+			locked = false;
+			return;
+		}
+		std::this_thread::yield();
+	}
+}
+
+WriterLock::~WriterLock()
+{
+	if (locked && !--writer_depth) writer_busy.store(false, std::memory_order_release);
+}
+
+// Reports how many times any recent messages have been repeated since they were last written.
+void write_repeat_summaries(int64_t when)
+{
+	if (!recent_repeats) return;
+	LogRecord summary_record;
+	summary_record.sequence = 0;
+	summary_record.deferred = false;
+	summary_record.site = 0;
+	summary_record.when = when;
+
+	// A short run of repeats of short messages is written out again in the order it happened, as a summary would save little and lose the order.
+	bool replay = (recent_repeats <= DEDUP_REPLAY);
+	for (size_t i = 0; replay && i < recent_repeats; i++)
+		if (!recent_messages[recent_repeat_order[i]].complete) replay = false;
+	for (size_t i = 0; replay && i < recent_repeats; i++)
+	{
+		RecentMessage &recent = recent_messages[recent_repeat_order[i]];
+		summary_record.thread = recent.thread;
+		summary_record.type = recent.type;
+		write_log_record(std::string_view(recent.text, recent.length), summary_record);
+	}
+
+	// If the only repeats are of the message written just before, the summary doesn't need to quote it. Anything written since, such as a critical
+	// error that bypassed the window, means it does.
+	const size_t last = (recent_messages_next + DEDUP_WINDOW - 1) % DEDUP_WINDOW;
+	bool only_last = recent_last_written;
+	for (size_t i = 0; i < DEDUP_WINDOW; i++)
+		if (i != last && recent_messages[i].repeats) only_last = false;
+
+	for (size_t i = 0; !replay && i < DEDUP_WINDOW; i++)
+	{
+		RecentMessage &recent = recent_messages[(recent_messages_next + i) % DEDUP_WINDOW];	// Oldest first.
+		if (!recent.used || !recent.repeats) continue;
+
+		char summary[DEDUP_SUMMARY_LENGTH + 64];
+		int size;
+		if (only_last) size = snprintf(summary, sizeof(summary), "Last message repeated %u times.", static_cast<unsigned int>(recent.repeats));
+		else size = snprintf(summary, sizeof(summary), "Message repeated %u times: %.*s%s", static_cast<unsigned int>(recent.repeats), static_cast<int>(recent.length), recent.text,
+			recent.length == DEDUP_SUMMARY_LENGTH ? "..." : "");
+		summary_record.thread = recent.thread;
+		summary_record.type = recent.type;
+		write_log_record(std::string_view(summary, size < static_cast<int>(sizeof(summary)) ? size : sizeof(summary) - 1), summary_record);
+	}
+
+	// Once a run of repeats is over, the window starts again, so later messages are only folded into a new storm rather than matched against old ones.
+	for (RecentMessage &recent : recent_messages)
+	{
+		recent.used = false;
+		recent.repeats = 0;
+	}
+	recent_messages_next = 0;
+	recent_repeats = 0;
+}
+
+// Defines a call site in the binary log, or only in a sink if one is given, so its ID can be resolved. The caller must hold a WriterLock.
+void write_site_definition(const CallSite &site, Sink *sink)
+{
+	const int64_t when = wall_clock_now();
+	const uint8_t type_byte = GURU_BINARY_SITE, site_type = static_cast<uint8_t>(site.type);
+	const uint32_t id = site.id.load(std::memory_order_relaxed), thread = 0, line = static_cast<uint32_t>(site.line);
+	const uint64_t sequence = 0;
+	const size_t file_len = strlen(site.file) + 1, function_len = strlen(site.function) + 1, format_len = strlen(site.format) + 1;
+	const uint32_t size = static_cast<uint32_t>(sizeof(line) + sizeof(site_type) + file_len + function_len + format_len);
+	log_line.clear();
+	log_line.append(reinterpret_cast<const char*>(&when), sizeof(when));
+	log_line.append(reinterpret_cast<const char*>(&type_byte), sizeof(type_byte));
+	log_line.append(reinterpret_cast<const char*>(&id), sizeof(id));
+	log_line.append(reinterpret_cast<const char*>(&thread), sizeof(thread));
+	log_line.append(reinterpret_cast<const char*>(&sequence), sizeof(sequence));
+	log_line.append(reinterpret_cast<const char*>(&size), sizeof(size));
+	log_line.append(reinterpret_cast<const char*>(&line), sizeof(line));
+	log_line.append(reinterpret_cast<const char*>(&site_type), sizeof(site_type));
+	log_line.append(site.file, file_len);
+	log_line.append(site.function, function_len);
+	log_line.append(site.format, format_len);
+	if (sink) sink->write(log_line.data(), log_line.size(), GURU_INFO);
+	else write_syslog(log_line.data(), log_line.size());
+}
+
+// Writes raw bytes to the log file, whichever way it's being written.
+void write_syslog(const char *data, size_t size)
+{
+	if (mmap_data)
+	{
+		while (mmap_used + size > mmap_size)
+		{
+			if (mmap_grow()) continue;
+
+			// If the file can't be grown any further, fall back to writing it the normal way.
+			mmap_close();
+			open_plain_file(syslog_filename, true);
+			break;
+		}
+	}
+	if (mmap_data)
+	{
+		memcpy(mmap_data + mmap_used, data, size);
+		mmap_used += size;
+	}
+	else if (syslog_is_open())
+	{
+		// The bytes are copied into syslog_buffer, which is written out whenever it fills up.
+		for (size_t done = 0; done < size; )
+		{
+			if (syslog_buffered == sizeof(syslog_buffer)) write_syslog_buffer();
+			const size_t chunk = std::min(size - done, sizeof(syslog_buffer) - syslog_buffered);
+			memcpy(syslog_buffer + syslog_buffered, data + done, chunk);
+			syslog_buffered += chunk;
+			done += chunk;
+		}
+	}
+	flush_pending += size;
+	segment_size += size;
+}
+
+// Writes out whatever is waiting in syslog_buffer.
+void write_syslog_buffer()
+{
+	const char *data = syslog_buffer;
+	size_t size = syslog_buffered;
+	syslog_buffered = 0;
+#ifdef GURU_POSIX
+	while (syslog_fd >= 0 && size)
+	{
+		const ssize_t written = write(syslog_fd, data, size);
+		if (written < 0 && errno == EINTR) continue;
+		if (written <= 0) return;
+		data += written;
+		size -= written;
+	}
+#else
+	if (size) syslog.write(data, size);
+#endif
 }
 
 }	// namespace guru
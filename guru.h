@@ -31,29 +31,133 @@ SOFTWARE.
 //#define GURU_USING_CONSOLE	// Uncomment this only if you are compiling a console-based application which is NOT using PDCurses or NCurses.
 //#define GURU_USING_LIBTCOD		// Uncomment this onyl if you are using libtcod.
 
+// Uncomment this line if zlib is available, so old log files can be compressed when using GURU_ROTATE. The CMake build does this for you if it finds zlib.
+//#define GURU_USING_ZLIB
+
 // Comment out this line if you DO NOT want to use Guru's stack-trace system.
 //#define GURU_USING_STACK_TRACE
 
+// Uncomment this line as well to count the calls to each stack_trace() function and time them, for log_function_timing() to report. Every instrumented call gets a little slower.
+//#define GURU_USING_FUNCTION_TIMING
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <exception>
-#ifdef GURU_USING_STACK_TRACE
-#include <stack>
-#endif
+#include <functional>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#if defined(GURU_USING_FUNCTION_TIMING) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define GURU_TIMING_TSC	// Function timing reads the CPU's timestamp counter, rather than the slower steady_clock.
+#include <x86intrin.h>
+#endif
 
 
+// Compiler hints, used to keep Guru's checks out of the way of the code that calls them.
+#if defined(__GNUC__) || defined(__clang__)
+#define GURU_COLD						__attribute__((cold, noinline))
+#define GURU_PRINTF(format_arg, first)	__attribute__((format(printf, format_arg, first)))
+#define GURU_UNLIKELY(x)				__builtin_expect(!!(x), 0)
+#else
+#define GURU_COLD
+#define GURU_PRINTF(format_arg, first)
+#define GURU_UNLIKELY(x)				(x)
+#endif
+
 namespace guru
 {
 
 #ifdef GURU_USING_STACK_TRACE
 // The stack-trace system. The advantage of this over traditional debug methods is that we can still strip symbol information (to keep the binary size down),
 // and it'll generate useful information in the log file even for regular players, rather than only when compiled/running in 'debug mode'.
+// Each thread keeps its own fixed-size stack, so pushing and popping never allocates. Frames deeper than GURU_STACK_DEPTH are counted in depth, but not recorded.
+#define GURU_STACK_DEPTH	256
+
+// Where a stack_trace() call is. Each call has its own static descriptor, so pushing a frame is still just one pointer.
+struct StackFrame
+{
+	const char		*function, *file;
+	unsigned int	line;
+	const char		*tag;	// An optional note added with stack_trace_tagged(), or nullptr.
+};
+
+#ifdef GURU_USING_FUNCTION_TIMING
+// Reads the clock used to time functions. Its ticks are converted to real time when the timings are reported.
+#ifdef GURU_TIMING_TSC
+inline uint64_t timing_ticks() { return __rdtsc(); }
+#else
+inline uint64_t timing_ticks() { return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count()); }
+#endif
+void	record_function_time(const char *function, uint64_t inclusive, uint64_t exclusive);	// Adds a call to a function's timing, in this thread's table.
+#endif
+
+// The signal fences cost nothing at runtime, but stop the compiler from merging or reordering the pushes and pops, so a signal handler always sees the stack as it really is.
 struct StackTrace
 {
-	StackTrace(const char *func);
-	~StackTrace();
-	static std::stack<const char*>	funcs;
+#ifndef GURU_USING_FUNCTION_TIMING
+	StackTrace(const StackFrame *frame) { if (depth < GURU_STACK_DEPTH) frames[depth] = frame; std::atomic_signal_fence(std::memory_order_seq_cst); depth++; std::atomic_signal_fence(std::memory_order_seq_cst); }
+	~StackTrace() { std::atomic_signal_fence(std::memory_order_seq_cst); depth--; }
+#else
+	// Each frame's time is added to its caller's children, so the time spent in the function itself can be worked out. Recursive functions count their inclusive time once per level.
+	StackTrace(const StackFrame *frame)
+	{
+		if (depth < GURU_STACK_DEPTH)
+		{
+			frames[depth] = frame;
+			children[depth] = 0;
+			started[depth] = timing_ticks();
+		}
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		depth++;
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+	}
+	~StackTrace()
+	{
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		const unsigned int frame = --depth;
+		if (frame >= GURU_STACK_DEPTH) return;
+		const uint64_t elapsed = timing_ticks() - started[frame];
+		if (frame) children[frame - 1] += elapsed;
+		record_function_time(frames[frame]->function, elapsed, elapsed - children[frame]);
+	}
+	inline static thread_local uint64_t	started[GURU_STACK_DEPTH];	// When each frame was entered, from timing_ticks().
+	inline static thread_local uint64_t	children[GURU_STACK_DEPTH];	// How many ticks each frame has spent in the instrumented functions it called.
+#endif
+	inline static thread_local const StackFrame	*frames[GURU_STACK_DEPTH];	// The frames on this thread's stack, outermost first.
+	inline static thread_local unsigned int		depth = 0;	// How many stack_trace() frames this thread is inside, including any that overflowed.
 };
-#define stack_trace()	guru::StackTrace local_stack(__PRETTY_FUNCTION__)
+#define stack_trace_tagged(tag)	static constexpr guru::StackFrame guru_stack_frame = { __PRETTY_FUNCTION__, __FILE__, __LINE__, tag }; guru::StackTrace local_stack(&guru_stack_frame)
+#define stack_trace()			stack_trace_tagged(nullptr)
+
+// A copy of the innermost frames of a thread's stack trace, taken by capture_trace() without disturbing the stack itself.
+#define GURU_TRACE_SIZE	16	// The most frames a TraceSnapshot holds.
+struct TraceSnapshot
+{
+	const StackFrame	*frames[GURU_TRACE_SIZE];	// Outermost first, as in StackTrace.
+	unsigned int		count;	// How many frames were copied.
+	unsigned int		depth;	// How deep the stack was when it was captured, including frames that weren't copied.
+};
+
+// Takes a snapshot of this thread's stack trace. It doesn't allocate, so it can be kept with an error to be logged later.
+inline TraceSnapshot capture_trace()
+{
+	TraceSnapshot trace;
+	trace.depth = StackTrace::depth;
+	const unsigned int recorded = (trace.depth < GURU_STACK_DEPTH ? trace.depth : GURU_STACK_DEPTH);
+	trace.count = (recorded < GURU_TRACE_SIZE ? recorded : GURU_TRACE_SIZE);
+	for (unsigned int i = 0; i < trace.count; i++)
+		trace.frames[i] = StackTrace::frames[recorded - trace.count + i];
+	return trace;
+}
+
+void	log_trace(const TraceSnapshot &trace);	// Logs a stack trace taken with capture_trace().
+#ifdef GURU_USING_FUNCTION_TIMING
+void	log_function_timing();	// Logs the number of calls to each stack_trace() function, and the time spent in it, across all threads. Also done by close_syslog().
+#endif
 #endif
 
 
@@ -65,14 +169,277 @@ struct StackTrace
 #define GURU_STACK		4	// Stack traces.
 #endif
 
-void	affirm(int condition, std::string error);	// Like assert(), but calls a Guru halt() if the condition is false.
+// Messages logged with the GURU_LOG macros below this level are compiled out entirely, including their arguments.
+// Above it, the runtime log level set with set_log_level() is checked before the arguments are evaluated.
+// Can be set from the compiler command line, e.g. -DGURU_MIN_LEVEL=GURU_WARN for release builds.
+#ifndef GURU_MIN_LEVEL
+#define GURU_MIN_LEVEL	GURU_INFO
+#endif
+
+#if GURU_MIN_LEVEL <= GURU_INFO
+#define GURU_LOG_INFO(...)		(guru::log_enabled(GURU_INFO) ? guru::log_unfiltered(__VA_ARGS__, GURU_INFO) : (void)0)
+#else
+#define GURU_LOG_INFO(...)		((void)0)
+#endif
+#if GURU_MIN_LEVEL <= GURU_WARN
+#define GURU_LOG_WARN(...)		(guru::log_enabled(GURU_WARN) ? guru::log_unfiltered(__VA_ARGS__, GURU_WARN) : (void)0)
+#else
+#define GURU_LOG_WARN(...)		((void)0)
+#endif
+#if GURU_MIN_LEVEL <= GURU_ERROR
+#define GURU_LOG_ERROR(...)		(guru::log_enabled(GURU_ERROR) ? guru::log_unfiltered(__VA_ARGS__, GURU_ERROR) : (void)0)
+#else
+#define GURU_LOG_ERROR(...)		((void)0)
+#endif
+#if GURU_MIN_LEVEL <= GURU_CRITICAL
+#define GURU_LOG_CRITICAL(...)	(guru::log_enabled(GURU_CRITICAL) ? guru::log_unfiltered(__VA_ARGS__, GURU_CRITICAL) : (void)0)
+#else
+#define GURU_LOG_CRITICAL(...)	((void)0)
+#endif
+
+// Like affirm(), but takes a printf-style error message which is only evaluated and formatted if the condition is false.
+#define GURU_AFFIRM(condition, ...)	do { if (GURU_UNLIKELY(!(condition))) guru::affirm_failed(__VA_ARGS__); } while(0)
+
+// Like logf(), but the file, line, function, severity and format string are kept in a static descriptor for the call site, rather than passed in on every call.
+// Only the descriptor and the arguments are captured at runtime, and binary logs store just the call site's ID and the arguments, defining each call site once per file.
+// How many times each call site was logged is reported when the log is closed. The format must be a string literal.
+// With Clang on ELF platforms, every descriptor goes in one linker section, so they can all be found when the log is opened. GCC can't mix the descriptors in inline
+// functions and templates with the rest in one section ("section type conflict"), so there, and elsewhere, each call site registers itself the first time it's used.
+#if defined(__clang__) && defined(__ELF__)
+#define GURU_SITE_SECTION	__attribute__((section("guru_sites"), used))
+#else
+#define GURU_SITE_SECTION
+#endif
+// The format is taken as the first of the variadic arguments, so a call with no arguments after it is still valid ISO C++ and stays quiet under -Wpedantic.
+#define GURU_LOGF(type, ...)	do { GURU_SITE_SECTION static guru::CallSite guru_call_site = { __FILE__, __func__, GURU_FIRST_ARG(__VA_ARGS__), __LINE__, type, {0}, {0} }; \
+	if (guru::log_enabled(type)) guru::log_site(guru_call_site, __VA_ARGS__); } while(0)
+#define GURU_FIRST_ARG(...)			GURU_FIRST_ARG_HELPER(__VA_ARGS__, 0)
+#define GURU_FIRST_ARG_HELPER(first, ...)	first
+
+// How many messages per second each GURU_LOG_LIMITED() or GURU_NONFATAL_LIMITED() call site can send before the rest are suppressed. Bursts of up to this many are allowed.
+#ifndef GURU_RATE_LIMIT
+#define GURU_RATE_LIMIT	10
+#endif
+
+// Like log() and nonfatal(), but each call site gets its own rate limit, so an error storm on one line can't flood the log. Suppressed messages aren't evaluated or formatted,
+// don't count towards a cascade failure, and are reported as a count at most once a second, when that call site is next allowed through.
+#define GURU_LOG_LIMITED(msg, type)			do { static guru::RateLimit guru_rate_limit; if (guru::log_enabled(type) && guru_rate_limit.allow(__FILE__, __LINE__)) guru::log_unfiltered(msg, type); } while(0)
+#define GURU_NONFATAL_LIMITED(error, type)	do { static guru::RateLimit guru_rate_limit; if (guru_rate_limit.allow(__FILE__, __LINE__)) guru::nonfatal(error, type); } while(0)
+
+// Options for open_syslog(), which can be combined with the | operator.
+// If none of the GURU_FLUSH options are given, the log file is flushed after every line. If neither of the GURU_CLOCK options are given, records are timestamped with the system clock.
+#define GURU_ASYNC			1	// Hands log records to a background writer thread, instead of writing them to disk on the calling thread.
+#define GURU_FLUSH_SIZE		2	// Flushes the log file once enough unwritten data has built up.
+#define GURU_FLUSH_INTERVAL	4	// Flushes the log file once enough time has passed since the last flush.
+#define GURU_FLUSH_SEVERITY	8	// Flushes the log file straight away when a serious error is logged.
+#define GURU_MMAP			16	// Writes the log through a memory-mapped file, so recent lines survive a crash in the OS page cache. POSIX only; ignored elsewhere.
+#define GURU_BINARY			32	// Writes compact binary records instead of text. Use the guru-decode tool to turn them back into text.
+#define GURU_ROTATE			64	// Starts a new log file when the current one gets too big or too old, keeping a few of the old ones. Old files are compressed on a background thread if zlib is available.
+#define GURU_FLIGHT_RECORDER	128	// Keeps the last few records of every severity in memory, even ones below the log level, and writes them to the log if halt() is called.
+#define GURU_CLOCK_TSC		256	// Timestamps records by reading the CPU's timestamp counter, calibrated against CLOCK_MONOTONIC when the log is opened. Only on x86 CPUs with an invariant TSC; the default clock is used elsewhere.
+#define GURU_CLOCK_COARSE	512	// Timestamps records with CLOCK_MONOTONIC_COARSE, which is very cheap but only accurate to a few milliseconds. Linux only; the default clock is used elsewhere.
+#define GURU_NONFATAL_TRACE	1024	// Logs a stack trace after each nonfatal() error of GURU_ERROR or higher. Needs GURU_USING_STACK_TRACE; ignored without it.
+#define GURU_PROFILE		2048	// Samples the stack_trace() stack of whichever thread is running, many times a second, and writes the results to the log's name plus .folded when it's closed, ready for flamegraph.pl. Needs GURU_USING_STACK_TRACE and POSIX; ignored otherwise.
+
+// The layout of log files written with GURU_BINARY. All values are in the writing machine's byte order.
+// The file starts with a header: the 4-byte magic string, a 1-byte version, 3 bytes of padding, then the local time's offset from UTC in seconds as a 4-byte signed integer.
+// Each record is an 8-byte signed timestamp in nanoseconds since the Unix epoch, a 1-byte severity, a 4-byte call-site ID (0 if unknown), a 4-byte thread ID,
+// an 8-byte sequence number giving the order the records were logged in across all threads, a 4-byte payload length, then the payload.
+// The payload is the message text if the call-site ID is 0, or the arguments captured by GURU_LOGF() if it isn't, in the same form as a LogfRecord after its first entry.
+// A record with the severity GURU_BINARY_SITE defines a call site before it's first used: its payload is the 4-byte line number, the 1-byte severity,
+// then the file name, function name and format string, each followed by a zero byte.
+#define GURU_BINARY_MAGIC		"GURU"
+#define GURU_BINARY_VERSION		3
+#define GURU_BINARY_HEADER_SIZE	12
+#define GURU_BINARY_RECORD_SIZE	29	// The size of a record, not counting its payload.
+#define GURU_BINARY_SITE		255	// The severity byte of a call-site definition record.
+
+#define GURU_LOGF_BUFFER	256	// The most bytes of arguments a single logf() call can capture. String arguments are truncated to fit.
+
+struct CallSite;
+struct LogfRecord;
+struct Sink;
+
+extern std::atomic<int>	capture_level;	// The lowest severity that's passed into Guru at all: the log level, or GURU_INFO when using GURU_FLIGHT_RECORDER.
+
+void	add_sink(Sink *sink);		// Sends everything written to the log file to this sink as well. The sink must stay alive until it's removed, or the log is closed.
+void	affirm(int condition, std::string_view error);	// Like assert(), but calls a Guru halt() if the condition is false.
+void	affirm_failed(const char *format, ...) GURU_COLD GURU_PRINTF(1, 2);	// Formats the error message for a failed GURU_AFFIRM(), then halts.
 void	close_syslog();				// Closes the Guru log file.
 void	console_ready(bool ready);	// Tells Guru whether or not the console is initialized and can handle rendering error messages.
-void	halt(std::string error);	// Stops the game and displays an error messge.
+void	format_logf(const char *format, std::string_view args, std::string &out);	// Formats arguments captured by logf(), as printf() would have. Used by guru-decode.
+void	halt(std::string_view error);	// Stops the game and displays an error messge.
 void	halt(std::exception &e);	// As above, but with an exception instead of a string.
 void	intercept_signal(int sig);	// Catches a segfault or other fatal signal.
-void	log(std::string msg, int type = GURU_INFO);	// Logs a message in the system log file.
-void	nonfatal(std::string error, int type);	// Reports a non-fatal error, which will be logged but will not halt execution unless it cascades.
-void	open_syslog(std::string filename = "");	// Opens the output log for messages.
+void	logf_record(int type, const LogfRecord &record);	// Logs a record built by logf(), formatting it straight away or handing it to the background writer.
+void	logf_site_record(CallSite &site, const LogfRecord &record);	// Logs a record built by GURU_LOGF(), registering its call site first if it hasn't been seen before.
+inline bool	log_enabled(int type) { return type >= capture_level.load(std::memory_order_relaxed); }	// Checks if messages of this severity are currently being logged or recorded.
+void	log_unfiltered(std::string_view msg, int type);	// Logs a message in the system log file, once log_enabled() has said it's wanted.
+inline void	log(std::string_view msg, int type = GURU_INFO) { if (log_enabled(type)) log_unfiltered(msg, type); }	// Logs a message in the system log file.
+void	nonfatal(std::string_view error, int type);	// Reports a non-fatal error, which will be logged but will not halt execution unless it cascades.
+void	open_syslog(std::string_view filename = "", unsigned int options = 0);	// Opens the output log for messages.
+void	remove_sink(Sink *sink);	// Stops sending log output to a sink added with add_sink().
+void	set_log_level(int type);	// Sets the lowest severity that will be logged, from GURU_INFO to GURU_CRITICAL.
+
+// The static descriptor of a GURU_LOGF() call site.
+struct CallSite
+{
+	const char		*file;
+	const char		*function;
+	const char		*format;
+	int				line;
+	int				type;
+	std::atomic<uint32_t>	id;		// 0 until the call site has been registered.
+	std::atomic<uint64_t>	count;	// How many times it's been logged.
+};
+
+// The arguments to a logf() call, captured so the formatting can be done later: the format string pointer ('f') or call site pointer ('c'), followed by each argument as a type byte and its raw value.
+struct LogfRecord
+{
+	LogfRecord(const char *format) { put('f', &format, sizeof(format)); }
+	LogfRecord(const CallSite &site) { const CallSite *pointer = &site; put('c', &pointer, sizeof(pointer)); }
+	void put(char tag, const void *value, size_t bytes)
+	{
+		if (size + 1 + bytes > GURU_LOGF_BUFFER) return;
+		data[size++] = tag;
+		memcpy(data + size, value, bytes);
+		size += bytes;
+	}
+	void put_string(std::string_view str)
+	{
+		if (size + 6 > GURU_LOGF_BUFFER) return;
+		const uint32_t len = static_cast<uint32_t>(str.size() < GURU_LOGF_BUFFER - size - 6 ? str.size() : GURU_LOGF_BUFFER - size - 6);
+		data[size++] = 's';
+		memcpy(data + size, &len, sizeof(len));
+		memcpy(data + size + sizeof(len), str.data(), len);
+		size += sizeof(len) + len;
+		data[size++] = '\0';
+	}
+	char	data[GURU_LOGF_BUFFER];
+	size_t	size = 0;
+};
+
+template<typename T> struct logf_unsupported : std::false_type { };
+
+// Copies a single logf() argument into the record. Strings are copied by value, as they may not outlive the call.
+template<typename T> inline void logf_capture(LogfRecord &record, const T &arg)
+{
+	if constexpr (std::is_enum<T>::value) logf_capture(record, static_cast<typename std::underlying_type<T>::type>(arg));
+	else if constexpr (std::is_integral<T>::value && std::is_signed<T>::value) { const int64_t value = arg; record.put('i', &value, sizeof(value)); }
+	else if constexpr (std::is_integral<T>::value) { const uint64_t value = arg; record.put('u', &value, sizeof(value)); }
+	else if constexpr (std::is_same<T, long double>::value) record.put('L', &arg, sizeof(arg));
+	else if constexpr (std::is_floating_point<T>::value) { const double value = arg; record.put('d', &value, sizeof(value)); }
+	else if constexpr (std::is_same<T, const char*>::value || std::is_same<T, char*>::value) record.put_string(arg ? std::string_view(arg) : std::string_view("(null)"));
+	else if constexpr (std::is_convertible<const T&, std::string_view>::value) record.put_string(arg);
+	else if constexpr (std::is_pointer<T>::value || std::is_null_pointer<T>::value) { const void *value = arg; record.put('p', &value, sizeof(value)); }
+	else static_assert(logf_unsupported<T>::value, "logf() can only capture numbers, enums, pointers and strings.");
+}
+
+// Logs a printf-style message. Only the format string pointer and a copy of the arguments are taken on the calling thread; with GURU_ASYNC, the formatting is done by the background writer.
+// The format string must outlive the program's logging, which string literals always do.
+template<typename... Args> inline void logf(int type, const char *format, const Args&... args)
+{
+	if (!log_enabled(type)) return;
+	LogfRecord record(format);
+	(logf_capture(record, args), ...);
+	logf_record(type, record);
+}
+
+// Logs a GURU_LOGF() call, once log_enabled() has said it's wanted. The format is already in the call site, and is only passed in to keep the macro simple.
+template<typename... Args> inline void log_site(CallSite &site, const char *, const Args&... args)
+{
+	LogfRecord record(site);
+	(logf_capture(record, args), ...);
+	logf_site_record(site, record);
+}
+
+// A token bucket for one call site of GURU_LOG_LIMITED() or GURU_NONFATAL_LIMITED(), kept as the time at which the bucket would next be full (the generic cell rate algorithm),
+// so a message can be let through with a single compare-and-swap. Suppressed messages are counted, and the count is logged by the writer once it's a second old.
+struct RateLimit
+{
+	static constexpr int64_t	interval = 1000000000 / GURU_RATE_LIMIT;	// Nanoseconds between messages at the steady rate.
+	static constexpr int64_t	burst = interval * (GURU_RATE_LIMIT - 1);	// How far ahead of now the bucket can be drained.
+	bool allow(const char *file, int line)
+	{
+		const int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		int64_t full_at = next_full.load(std::memory_order_relaxed);
+		while (true)
+		{
+			const int64_t from = (full_at > now ? full_at : now);
+			if (from - now > burst)
+			{
+				if (GURU_UNLIKELY(!suppressed.fetch_add(1, std::memory_order_relaxed))) start_suppressing(file, line, now);
+				return false;
+			}
+			if (next_full.compare_exchange_weak(full_at, from + interval, std::memory_order_relaxed)) return true;
+		}
+	}
+	void	report_suppressed(int64_t now, bool force);	// Logs how many messages have been suppressed, if the first of them was at least a second ago, or if force is set.
+	void	start_suppressing(const char *file, int line, int64_t now) GURU_COLD;	// Notes when a run of suppressed messages began, and puts this call site on the list the writer checks.
+	const char				*file = nullptr;	// The call site, filled in when it first suppresses anything.
+	int						line = 0;
+	std::atomic<bool>		listed = {false};	// Is this on the list of call sites that have suppressed messages?
+	RateLimit				*next = nullptr;	// The next call site on that list.
+	std::atomic<int64_t>	next_full = {0};	// Steady-clock nanoseconds.
+	std::atomic<uint32_t>	suppressed = {0};	// Messages suppressed since the last report.
+	std::atomic<int64_t>	suppressed_since = {0};	// When the first of those messages was suppressed, in steady-clock nanoseconds.
+};
+
+// Somewhere to send log output, as well as the log file. Each record is formatted once, and the same bytes are handed to every sink: a text line, or a binary record
+// when using GURU_BINARY. A binary sink is first sent the file header and call site definitions, and then any new definitions as they happen, so what it receives
+// can be read by guru-decode just like the log file; rotation doesn't restart it. Sinks are only ever called by one thread at a time, and must not log anything themselves.
+struct Sink
+{
+	virtual			~Sink() { }
+	virtual void	flush() { }	// Called whenever the log file is flushed.
+	virtual void	write(const char *data, size_t size, int type) = 0;
+};
+
+// Hands log output to a function.
+struct CallbackSink : public Sink
+{
+	CallbackSink(std::function<void(std::string_view data, int type)> callback) : callback(std::move(callback)) { }
+	void	write(const char *data, size_t size, int type) override { callback(std::string_view(data, size), type); }
+	std::function<void(std::string_view data, int type)>	callback;
+};
+
+// Writes log output to another file.
+struct FileSink : public Sink
+{
+	FileSink(const std::string &filename);
+	~FileSink();
+	void	flush() override;
+	void	write(const char *data, size_t size, int type) override;
+	FILE	*file;
+};
+
+// Keeps the most recent log output in memory, overwriting the oldest once it's full.
+struct MemorySink : public Sink
+{
+	MemorySink(size_t capacity);
+	std::string	contents();	// Returns a copy of everything held, oldest first. The oldest line may have been partly overwritten.
+	void	write(const char *data, size_t size, int type) override;
+	std::string	buffer;
+	size_t		next = 0;		// Where the next byte will be written.
+	bool		wrapped = false;	// Has the buffer filled up and started overwriting itself?
+};
+
+// Sends log output to a UNIX domain stream socket, such as a log collector. Records that don't fit in the socket's buffer are dropped, and a collector that
+// stops reading partway through one is disconnected. POSIX only; elsewhere, nothing is sent.
+struct SocketSink : public Sink
+{
+	SocketSink(const std::string &path);
+	~SocketSink();
+	void	write(const char *data, size_t size, int type) override;
+	uint64_t	dropped = 0;	// Records dropped because the socket was full. The writer never waits for the collector.
+	int		fd = -1;
+};
+
+// Writes log output to stderr.
+struct StderrSink : public Sink
+{
+	void	flush() override { fflush(stderr); }
+	void	write(const char *data, size_t size, int) override { fwrite(data, 1, size, stderr); }
+};
 
 }	// namespace guru
@@ -0,0 +1,280 @@
+/* guru-bench.cpp -- Microbenchmarks for the Guru API, to catch performance regressions between releases.
+   Usage: guru-bench [--iterations N] [--threads N] [--json]
+   Each benchmark reports the time and heap allocations per call, single-threaded and with several threads calling at once.
+   With --json, the results are written to standard output as JSON rather than as a table.
+
+MIT License
+
+Copyright (c) 2019-2020 Raine "Gravecat" Simmons.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "guru.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+#define BENCH_FILENAME		"guru-bench.log"	// The log file written while benchmarking. It's deleted afterwards.
+#define BENCH_ITERATIONS	200000	// The default number of calls each thread makes in each benchmark.
+#define BENCH_MESSAGES		16		// The number of distinct messages cycled through, so the log's repeat detection doesn't swallow them.
+#define BENCH_NONFATAL_BATCH	16	// How many nonfatal() calls are made before the log is reopened, to stay clear of a cascade failure.
+#define BENCH_THREADS		4		// The default number of threads in the multi-threaded runs.
+
+std::atomic<uint64_t>	allocations(0);	// Every heap allocation made by the process, counted by the operator new replacements below.
+
+void* operator new(size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void *ptr = malloc(size ? size : 1)) return ptr;
+	throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { allocations.fetch_add(1, std::memory_order_relaxed); return malloc(size ? size : 1); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return operator new(size, std::nothrow); }
+void operator delete(void *ptr) noexcept { free(ptr); }
+void operator delete[](void *ptr) noexcept { free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { free(ptr); }
+
+// The measurements taken from one benchmark.
+struct BenchResult
+{
+	std::string	name, mode;	// The API being measured, and the way the log was opened for it.
+	unsigned int	threads;	// How many threads were calling at once.
+	size_t		iterations;	// How many calls each thread made.
+	double		ns_per_op;	// The average wall-clock time of one call, as seen by the thread making it.
+	double		allocs_per_op;	// The average number of heap allocations made per call, across all threads.
+};
+
+// One benchmark: a loop making the given number of calls, run on each thread at once.
+struct Benchmark
+{
+	const char	*name;
+	void		(*body)(size_t iterations);
+};
+
+std::string	messages[BENCH_MESSAGES];	// The distinct messages that are logged, built before any timing starts.
+volatile bool	always_true = true;	// Read by the affirm benchmarks, so the compiler can't fold the condition away.
+
+#ifdef GURU_USING_STACK_TRACE
+// A function with a stack_trace() in it and nothing else, so the benchmark measures just the push and pop.
+__attribute__((noinline)) void traced_function() { stack_trace(); }
+#endif
+
+// The benchmark loops.
+void bench_affirm(size_t iterations) { for (size_t i = 0; i < iterations; i++) guru::affirm(always_true, "This never fails."); }
+void bench_affirm_macro(size_t iterations) { for (size_t i = 0; i < iterations; i++) GURU_AFFIRM(always_true, "This never fails."); }
+void bench_log(size_t iterations) { for (size_t i = 0; i < iterations; i++) guru::log(messages[i % BENCH_MESSAGES]); }
+void bench_log_filtered(size_t iterations) { for (size_t i = 0; i < iterations; i++) GURU_LOG_INFO(messages[i % BENCH_MESSAGES]); }
+void bench_log_limited(size_t iterations) { for (size_t i = 0; i < iterations; i++) GURU_LOG_LIMITED(messages[i % BENCH_MESSAGES], GURU_INFO); }
+void bench_logf(size_t iterations) { for (size_t i = 0; i < iterations; i++) guru::logf(GURU_INFO, "Benchmark message %zu of %s.", i, "logf"); }
+void bench_logf_site(size_t iterations) { for (size_t i = 0; i < iterations; i++) GURU_LOGF(GURU_INFO, "Benchmark message %zu of %s.", i, "GURU_LOGF"); }
+#ifdef GURU_USING_STACK_TRACE
+void bench_stack_trace(size_t iterations) { for (size_t i = 0; i < iterations; i++) traced_function(); }
+#endif
+
+// The benchmarks that need the log to be open. These are run once for each way of opening it.
+const Benchmark	log_benchmarks[] = {
+	{ "log", bench_log },
+	{ "log_filtered", bench_log_filtered },
+	{ "log_limited", bench_log_limited },
+	{ "logf", bench_logf },
+	{ "GURU_LOGF", bench_logf_site },
+};
+
+// The benchmarks that don't touch the log file at all.
+const Benchmark	plain_benchmarks[] = {
+	{ "affirm", bench_affirm },
+	{ "GURU_AFFIRM", bench_affirm_macro },
+#ifdef GURU_USING_STACK_TRACE
+	{ "stack_trace", bench_stack_trace },
+#endif
+};
+
+// The ways the log is opened for the log benchmarks.
+const struct { const char *name; unsigned int options; } log_modes[] = {
+	{ "sync", 0 },
+	{ "async", GURU_ASYNC },
+	{ "binary", GURU_BINARY },
+};
+
+// Runs a benchmark on the given number of threads, after a short warm-up, and measures it.
+BenchResult run_benchmark(const Benchmark &bench, const char *mode, unsigned int threads, size_t iterations)
+{
+	bench.body(iterations / 10 + 1);
+
+	std::atomic<unsigned int> ready(0);
+	std::atomic<bool> go(false);
+	std::vector<std::chrono::nanoseconds> elapsed(threads);
+	auto worker = [&](unsigned int index)
+	{
+		ready.fetch_add(1);
+		while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+		const auto start = std::chrono::steady_clock::now();
+		bench.body(iterations);
+		elapsed.at(index) = std::chrono::steady_clock::now() - start;
+	};
+
+	std::vector<std::thread> pool;
+	pool.reserve(threads);
+	for (unsigned int i = 1; i < threads; i++) pool.emplace_back(worker, i);
+	while (ready.load() < threads - 1) std::this_thread::yield();
+	const uint64_t allocs_before = allocations.load();
+	ready.fetch_add(1);
+	go.store(true, std::memory_order_release);
+	worker(0);
+	for (auto &thread : pool) thread.join();
+	const uint64_t allocs = allocations.load() - allocs_before;
+
+	std::chrono::nanoseconds total(0);
+	for (auto time : elapsed) total += time;
+	const double ops = static_cast<double>(iterations) * threads;
+	return { bench.name, mode, threads, iterations, total.count() / ops, allocs / ops };
+}
+
+// nonfatal() halts if it's called too often, so it's timed in small batches shared between the threads, reopening the log (which starts a new cascade window) in between.
+BenchResult run_nonfatal_benchmark(const char *mode, unsigned int options, unsigned int threads, size_t iterations)
+{
+	if (threads > BENCH_NONFATAL_BATCH) threads = BENCH_NONFATAL_BATCH;
+	const size_t share = BENCH_NONFATAL_BATCH / threads;	// How many calls each thread makes in each batch.
+	std::vector<std::chrono::nanoseconds> elapsed(threads);
+	uint64_t allocs = 0;
+	size_t calls = 0;	// How many calls each thread has made.
+	while (calls < iterations)
+	{
+		guru::close_syslog();
+		guru::open_syslog(BENCH_FILENAME, options);
+		std::atomic<unsigned int> ready(0);
+		std::atomic<bool> go(false);
+		auto worker = [&](unsigned int index)
+		{
+			ready.fetch_add(1);
+			while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+			const auto start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < share; i++) guru::nonfatal(messages[(index * share + i) % BENCH_MESSAGES], GURU_WARN);
+			elapsed.at(index) += std::chrono::steady_clock::now() - start;
+		};
+
+		std::vector<std::thread> pool;
+		pool.reserve(threads);
+		for (unsigned int i = 1; i < threads; i++) pool.emplace_back(worker, i);
+		while (ready.load() < threads - 1) std::this_thread::yield();
+		const uint64_t allocs_before = allocations.load();
+		ready.fetch_add(1);
+		go.store(true, std::memory_order_release);
+		worker(0);
+		for (auto &thread : pool) thread.join();
+		allocs += allocations.load() - allocs_before;
+		calls += share;
+	}
+
+	std::chrono::nanoseconds total(0);
+	for (auto time : elapsed) total += time;
+	const double ops = static_cast<double>(calls) * threads;
+	return { "nonfatal", mode, threads, calls, total.count() / ops, allocs / ops };
+}
+
+// Writes a string as a JSON string literal. The names here never need more than quotes and backslashes escaped.
+void write_json_string(std::ostream &out, const std::string &str)
+{
+	out << '"';
+	for (char c : str)
+	{
+		if (c == '"' || c == '\\') out << '\\';
+		out << c;
+	}
+	out << '"';
+}
+
+int main(int argc, char **argv)
+{
+	size_t iterations = BENCH_ITERATIONS;
+	unsigned int threads = BENCH_THREADS;
+	bool json = false;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--json")) json = true;
+		else if (!strcmp(argv[i], "--iterations") && i + 1 < argc) iterations = strtoul(argv[++i], nullptr, 10);
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc) threads = strtoul(argv[++i], nullptr, 10);
+		else
+		{
+			std::cerr << "Usage: " << argv[0] << " [--iterations N] [--threads N] [--json]" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	if (!iterations) iterations = 1;
+	if (threads < 2) threads = 2;
+	for (int i = 0; i < BENCH_MESSAGES; i++) messages[i] = "Benchmark message " + std::to_string(i) + ", long enough to be a fairly typical line in a log file.";
+
+	std::vector<BenchResult> results;
+	for (const auto &mode : log_modes)
+	{
+		guru::open_syslog(BENCH_FILENAME, mode.options);
+		for (const auto &bench : log_benchmarks)
+		{
+			if (bench.body == bench_log_filtered) guru::set_log_level(GURU_WARN);
+			results.push_back(run_benchmark(bench, mode.name, 1, iterations));
+			results.push_back(run_benchmark(bench, mode.name, threads, iterations));
+			guru::set_log_level(GURU_INFO);
+		}
+		results.push_back(run_nonfatal_benchmark(mode.name, mode.options, 1, iterations / 100));
+		results.push_back(run_nonfatal_benchmark(mode.name, mode.options, threads, iterations / 100));
+		guru::close_syslog();
+	}
+	for (const auto &bench : plain_benchmarks)
+	{
+		results.push_back(run_benchmark(bench, "none", 1, iterations));
+		results.push_back(run_benchmark(bench, "none", threads, iterations));
+	}
+	remove(BENCH_FILENAME);
+
+	if (json)
+	{
+		std::cout << "{\n\t\"iterations\": " << iterations << ",\n\t\"threads\": " << threads << ",\n\t\"benchmarks\": [\n";
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			const BenchResult &result = results.at(i);
+			std::cout << "\t\t{ \"name\": ";
+			write_json_string(std::cout, result.name);
+			std::cout << ", \"mode\": ";
+			write_json_string(std::cout, result.mode);
+			std::cout << ", \"threads\": " << result.threads << ", \"iterations\": " << result.iterations << ", \"ns_per_op\": " << result.ns_per_op << ", \"allocs_per_op\": " << result.allocs_per_op
+				<< " }" << (i + 1 < results.size() ? "," : "") << "\n";
+		}
+		std::cout << "\t]\n}" << std::endl;
+	}
+	else
+	{
+		printf("%-16s %-8s %7s %12s %12s %14s\n", "benchmark", "mode", "threads", "iterations", "ns/op", "allocs/op");
+		for (const auto &result : results)
+			printf("%-16s %-8s %7u %12zu %12.1f %14.4f\n", result.name.c_str(), result.mode.c_str(), result.threads, result.iterations, result.ns_per_op, result.allocs_per_op);
+	}
+	return EXIT_SUCCESS;
+}
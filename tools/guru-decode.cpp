@@ -0,0 +1,169 @@
+/* guru-decode.cpp -- Converts Guru binary log files back into text.
+   Usage: guru-decode <binary log file> [output file]
+   If no output file is given, the text is written to standard output.
+
+MIT License
+
+Copyright (c) 2019-2020 Raine "Gravecat" Simmons.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "guru.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+// Reads exactly size bytes from the file. Returns false at the end of the file.
+bool read_bytes(std::ifstream &file, void *data, size_t size)
+{
+	file.read(static_cast<char*>(data), size);
+	return static_cast<size_t>(file.gcount()) == size;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2 || argc > 3)
+	{
+		std::cerr << "Usage: " << argv[0] << " <binary log file> [output file]" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::ifstream input(argv[1], std::ios::in | std::ios::binary);
+	if (!input.is_open())
+	{
+		std::cerr << "Could not open " << argv[1] << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::ofstream output_file;
+	if (argc == 3)
+	{
+		output_file.open(argv[2]);
+		if (!output_file.is_open())
+		{
+			std::cerr << "Could not open " << argv[2] << " for writing." << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	std::ostream &output = (argc == 3 ? output_file : std::cout);
+	input.seekg(0, std::ios::end);
+	const uint64_t file_size = static_cast<uint64_t>(input.tellg());	// Nothing in the file can claim to be bigger than this, however damaged it is.
+	input.seekg(0, std::ios::beg);
+
+	char header[GURU_BINARY_HEADER_SIZE];
+	if (!read_bytes(input, header, sizeof(header)) || memcmp(header, GURU_BINARY_MAGIC, 4))
+	{
+		std::cerr << argv[1] << " is not a Guru binary log file." << std::endl;
+		return EXIT_FAILURE;
+	}
+	const int version = header[4];
+	if (version < 1 || version > GURU_BINARY_VERSION)
+	{
+		std::cerr << argv[1] << " is binary log version " << version << ", but this tool only understands up to version " << GURU_BINARY_VERSION << "." << std::endl;
+		return EXIT_FAILURE;
+	}
+	const size_t record_size = (version == 1 ? 17 : GURU_BINARY_RECORD_SIZE);	// Version 1 had no thread IDs or sequence numbers.
+	int32_t utc_offset;
+	memcpy(&utc_offset, header + 8, sizeof(utc_offset));
+
+	std::vector<std::string> formats;	// The format string of each GURU_LOGF() call site, by ID minus one.
+	std::string payload, text;
+	while (true)
+	{
+		char record[GURU_BINARY_RECORD_SIZE];
+		if (!read_bytes(input, record, record_size)) break;
+		int64_t when;
+		uint8_t type;
+		uint32_t size, site = 0, thread = 1;
+		memcpy(&when, record, sizeof(when));
+		memcpy(&type, record + 8, sizeof(type));
+		if (version == 1) memcpy(&size, record + 13, sizeof(size));
+		else
+		{
+			memcpy(&site, record + 9, sizeof(site));
+			memcpy(&thread, record + 13, sizeof(thread));
+			memcpy(&size, record + 25, sizeof(size));
+		}
+		if (!when && !type && !size) break;	// The zero padding at the end of a GURU_MMAP file that wasn't closed cleanly.
+		if (size > file_size - static_cast<uint64_t>(input.tellg()))
+		{
+			std::cerr << "Warning: a record in " << argv[1] << " is damaged or truncated, so the rest can't be decoded." << std::endl;
+			break;
+		}
+		payload.resize(size);
+		if (size && !read_bytes(input, &payload[0], size))
+		{
+			std::cerr << "Warning: the last record in " << argv[1] << " is truncated." << std::endl;
+			break;
+		}
+
+		// Call-site definitions aren't printed, just remembered for the records that refer to them.
+		if (type == GURU_BINARY_SITE)
+		{
+			const size_t file_start = sizeof(uint32_t) + 1;
+			const size_t function_start = payload.find('\0', file_start) + 1;
+			const size_t format_start = (function_start ? payload.find('\0', function_start) + 1 : 0);
+			if (!site || !function_start || !format_start || format_start >= payload.size()) continue;
+			if (site > file_size / record_size)	// Each call site has its own definition record, so there can't be more of them than this.
+			{
+				std::cerr << "Warning: " << argv[1] << " has a damaged call site definition, so the rest can't be decoded." << std::endl;
+				break;
+			}
+			if (formats.size() < site) formats.resize(site);
+			formats.at(site - 1) = payload.c_str() + format_start;
+			continue;
+		}
+		if (site)
+		{
+			if (site <= formats.size()) guru::format_logf(formats.at(site - 1).c_str(), payload, text);
+			else text = "(unknown call site " + std::to_string(site) + ")";
+		}
+		const std::string &message = (site ? text : payload);
+
+		// The timestamps are in UTC, so shift them into the local time of the machine that wrote the log.
+		const time_t seconds = static_cast<time_t>(when / 1000000000) + utc_offset;
+		tm local;
+#ifdef _WIN32
+		gmtime_s(&local, &seconds);
+#else
+		gmtime_r(&seconds, &local);
+#endif
+		char time_str[16];
+		strftime(time_str, sizeof(time_str), "%H:%M:%S", &local);
+
+		const char *txt_tag = "";
+		switch(type)
+		{
+			case GURU_WARN: txt_tag = "[WARN] "; break;
+			case GURU_ERROR: txt_tag = "[ERROR] "; break;
+			case GURU_CRITICAL: txt_tag = "[CRITICAL] "; break;
+		}
+		output << "[" << time_str << "] ";
+		if (thread > 1) output << "[T" << thread << "] ";	// Matches the text log, where the first thread to log anything isn't tagged.
+		output << txt_tag << message << "\n";
+	}
+	return EXIT_SUCCESS;
+}